@@ -5,7 +5,9 @@
 #include <experimental/string_view>
 
 using u8 = unsigned char;
+using u16 = uint16_t;
 using u32 = uint32_t;
+using u64 = uint64_t;
 using string_view = std::experimental::string_view;
 #define UNLIKELY(x) (__builtin_expect(x, 0))
 #define LIKELY(x) (__builtin_expect(!!(x), 1))
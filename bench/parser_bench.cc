@@ -0,0 +1,242 @@
+// Parser throughput benchmark.
+// Replays byte streams through EscapeParser with actions that do nothing,
+// in 1024-byte buffers like Shell::Read, and reports MB/s and ns/byte.
+// The switch-based parser that the fuzzer keeps as a reference runs on the
+// same buffers for comparison, fed a rune at a time as it was before.
+//
+// With no arguments, it runs synthetic corpora for common workloads.
+// Otherwise each argument is a recorded capture of PTY output, e.g. from
+//   script -q -c htop htop.capture
+
+#include "../escape_parser.h"
+#include "../fuzz/reference_parser.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+class NullActions final : public EscapeParser::Actions {
+ public:
+  void Control(u8 /*control*/) override {}
+  void Escape(string_view /*command*/) override {}
+  void CSI(string_view /*command*/, const EscapeParser::Args& /*args*/)
+      override {}
+  void DCSHook(string_view /*command*/, const EscapeParser::Args& /*args*/)
+      override {}
+  void DCSPut(string_view /*data*/) override {}
+  void DCSUnhook() override {}
+  void OSCStart() override {}
+  void OSCPut(string_view /*data*/) override {}
+  void OSCEnd() override {}
+};
+
+class NullReferenceActions final : public ReferenceActions {
+ public:
+  void Event(const char* /*name*/, string_view /*detail*/) override {}
+  void Text(const char* /*name*/, string_view /*text*/) override {}
+};
+
+constexpr static size_t kCorpusSize = 4 << 20;
+
+static std::string Printf(const char* format, ...)
+    __attribute__((format(printf, 1, 2)));
+static std::string Printf(const char* format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return std::string(buf, std::min<size_t>(size, sizeof(buf) - 1));
+}
+
+// std::mt19937, but returning u32 rather than uint_fast32_t, which may be
+// too wide for %u.
+class Random {
+ public:
+  explicit Random(u32 seed) : engine_(seed) {}
+  u32 operator()() { return engine_(); }
+
+ private:
+  std::mt19937 engine_;
+};
+
+static std::string Word(Random& rng, const std::vector<u32>& alphabet) {
+  std::string result;
+  for (int length = 1 + rng() % 8; length; --length) {
+    char utf8[4];
+    result.append(utf8, EncodeUTF8(alphabet[rng() % alphabet.size()], utf8));
+  }
+  return result;
+}
+
+static std::vector<u32> Range(u32 begin, u32 end) {
+  std::vector<u32> result;
+  for (u32 rune = begin; rune < end; ++rune) result.push_back(rune);
+  return result;
+}
+
+// A build or server log: plain ASCII lines.
+static std::string PlainLog() {
+  Random rng(1);
+  std::string result;
+  const char* levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+  while (result.size() < kCorpusSize) {
+    result += Printf("[%6u.%03u] %s worker-%u: processed %u items in %ums\r\n",
+                     rng() % 100000, rng() % 1000, levels[rng() % 5],
+                     rng() % 16, rng() % 10000, rng() % 500);
+  }
+  return result;
+}
+
+// Colored compiler diagnostics, as from clang: SGR around most tokens.
+static std::string CompilerOutput() {
+  Random rng(2);
+  auto ascii = Range('a', 'z' + 1);
+  std::string result;
+  while (result.size() < kCorpusSize) {
+    result += Printf("\x1b[1m%s.cc:%u:%u: \x1b[0m\x1b[0;1;31merror: \x1b[0m"
+                     "\x1b[1mno member named '%s' in '%s'\x1b[0m\r\n",
+                     Word(rng, ascii).c_str(), rng() % 1000, rng() % 80,
+                     Word(rng, ascii).c_str(), Word(rng, ascii).c_str());
+    result += Printf("  %s.%s(\x1b[38;5;%um%u\x1b[0m);\r\n",
+                     Word(rng, ascii).c_str(), Word(rng, ascii).c_str(),
+                     rng() % 256, rng() % 100);
+    result += "\x1b[0;1;32m  ~~~~^\r\n\x1b[0m";
+  }
+  return result;
+}
+
+// A full-screen app like htop: every few cells are cursor-addressed.
+static std::string FullScreen() {
+  Random rng(3);
+  std::string result;
+  while (result.size() < kCorpusSize) {
+    result += Printf("\x1b[%u;%uH\x1b[%u;%um%c%c\x1b[0m", rng() % 50 + 1,
+                     rng() % 200 + 1, rng() % 2, 30 + rng() % 8,
+                     'a' + rng() % 26, ' ' + rng() % 64);
+    if (rng() % 64 == 0) result += "\x1b[?25l\x1b[H\x1b[2J\x1b[?25h";
+  }
+  return result;
+}
+
+// Localized output: CJK and emoji mixed with ASCII.
+static std::string UTF8Text() {
+  Random rng(4);
+  std::vector<std::vector<u32>> alphabets = {
+    Range('a', 'z' + 1), Range(0xe0, 0x100), Range(0x4e00, 0x9fa0),
+    Range(0x1f600, 0x1f650),
+  };
+  std::string result;
+  while (result.size() < kCorpusSize) {
+    for (int words = 2 + rng() % 10; words; --words)
+      result += Word(rng, alphabets[rng() % alphabets.size()]) + " ";
+    result += "\r\n";
+  }
+  return result;
+}
+
+// Clipboard writes (OSC 52) and hyperlinks (OSC 8) with large payloads.
+static std::string LargeOSC() {
+  Random rng(5);
+  const char base64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string result;
+  while (result.size() < kCorpusSize) {
+    result += "\x1b]52;c;";
+    for (int i = 0; i < 65536; ++i) result.push_back(base64[rng() % 64]);
+    result += "\x07";
+    for (int i = 0; i < 100; ++i) {
+      result += Printf("\x1b]8;;file:///home/user/src/project/file%u.cc\x1b\\"
+                       "file%u.cc\x1b]8;;\x1b\\\r\n", i, i);
+    }
+  }
+  return result;
+}
+
+template <typename Parser, typename ActionsT>
+static double Time(const std::string& corpus) {
+  using Clock = std::chrono::steady_clock;
+  ActionsT actions;
+  Parser parser(&actions);
+  size_t bytes = 0, printed = 0;
+  auto print = [&](auto /*text*/, auto... count) { printed += sizeof...(count) + 1; };
+  auto start = Clock::now();
+  auto elapsed = [&] { return std::chrono::duration<double>(Clock::now() - start).count(); };
+  do {
+    const u8* data = reinterpret_cast<const u8*>(corpus.data());
+    for (size_t i = 0; i < corpus.size(); i += 1024)
+      parser.ConsumeSpan(data + i, std::min<size_t>(1024, corpus.size() - i), print);
+    bytes += corpus.size();
+  } while (elapsed() < 0.5);
+  return elapsed() / bytes;
+}
+
+// Like Time(), but for ReferenceParser: bytes are decoded as they arrive,
+// and each rune goes to Consume(), and is printed alone if it returns false.
+// The reference also writes parameters out as text for its actions, which
+// the old parser didn't, so this is somewhat slower than that was.
+static double TimeSwitch(const std::string& corpus) {
+  using Clock = std::chrono::steady_clock;
+  NullReferenceActions actions;
+  ReferenceParser parser(&actions);
+  UTF8Decoder decoder;
+  size_t bytes = 0, printed = 0;
+  auto print = [&](const u32* /*runes*/, int count) { printed += count; };
+  auto start = Clock::now();
+  auto elapsed = [&] { return std::chrono::duration<double>(Clock::now() - start).count(); };
+  do {
+    const u8* data = reinterpret_cast<const u8*>(corpus.data());
+    for (size_t i = 0; i < corpus.size(); i += 1024) {
+      const u8 *p = data + i, *end = p + std::min<size_t>(1024, corpus.size() - i);
+      while (p != end) {
+        if (!decoder.pending() && *p < 0x80) {
+          u32 rune = *p++;
+          if (!parser.Consume(rune)) print(&rune, 1);
+          continue;
+        }
+        u32 runes[64];
+        int count;
+        p = decoder.Decode(p, end, runes, 64, &count);
+        for (int j = 0; j < count; ++j) {
+          if (!parser.Consume(runes[j])) print(&runes[j], 1);
+        }
+      }
+    }
+    bytes += corpus.size();
+  } while (elapsed() < 0.5);
+  return elapsed() / bytes;
+}
+
+static void Run(const std::string& name, const std::string& corpus) {
+  double direct = Time<BasicEscapeParser<NullActions>, NullActions>(corpus);
+  double virt = Time<EscapeParser, NullActions>(corpus);
+  double old = TimeSwitch(corpus);
+  printf("%-20s %8zu KB  direct %8.1f MB/s %6.3f ns/byte"
+         "  virtual %8.1f MB/s %6.3f ns/byte  switch %8.1f MB/s %6.3f ns/byte\n",
+         name.c_str(), corpus.size() >> 10, 1e-6 / direct, direct * 1e9,
+         1e-6 / virt, virt * 1e9, 1e-6 / old, old * 1e9);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      std::ifstream file(argv[i], std::ios::binary);
+      if (!file) {
+        fprintf(stderr, "can't read %s\n", argv[i]);
+        return 1;
+      }
+      Run(argv[i], std::string(std::istreambuf_iterator<char>(file), {}));
+    }
+    return 0;
+  }
+  Run("plain log", PlainLog());
+  Run("compiler output", CompilerOutput());
+  Run("full-screen app", FullScreen());
+  Run("utf-8 text", UTF8Text());
+  Run("large osc", LargeOSC());
+}
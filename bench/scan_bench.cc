@@ -0,0 +1,103 @@
+// Microbenchmark for the printable-run scan in EscapeParser::ConsumeSpan.
+// Splits 1024-byte read buffers into runs the way the parser does with each
+// FindNonPrintable kernel, and compares them with the path before
+// ConsumeSpan, which fed every byte to Consume() and printed runes one by one.
+
+#include "../escape_parser.h"
+#include "../scan.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+class NullActions final : public EscapeParser::Actions {
+ public:
+  void Control(u8 /*control*/) override {}
+  void Escape(string_view /*command*/) override {}
+  void CSI(string_view /*command*/, const EscapeParser::Args& /*args*/)
+      override {}
+  void DCSHook(string_view /*command*/, const EscapeParser::Args& /*args*/)
+      override {}
+  void DCSPut(string_view /*data*/) override {}
+  void DCSUnhook() override {}
+  void OSCStart() override {}
+  void OSCPut(string_view /*data*/) override {}
+  void OSCEnd() override {}
+};
+
+// Each rune is a run of its own. Kept out of line, like Shell's printing.
+static __attribute__((noinline)) void PrintRune(u32 /*rune*/, size_t* runs) {
+  ++*runs;
+}
+
+// Chops a long stream into 1024-byte buffers, like Shell::read_buf_.
+static std::vector<std::vector<u8>> Buffers(int line_length) {
+  std::mt19937 rng(42);
+  std::vector<u8> stream;
+  while (stream.size() < (1 << 20)) {
+    int length = line_length ? line_length / 2 + rng() % line_length : 1 << 20;
+    for (int i = 0; i < length; ++i) stream.push_back(0x20 + rng() % 0x5f);
+    stream.push_back('\n');
+  }
+  std::vector<std::vector<u8>> buffers;
+  for (size_t i = 0; i + 1024 <= stream.size(); i += 1024)
+    buffers.emplace_back(stream.begin() + i, stream.begin() + i + 1024);
+  return buffers;
+}
+
+// Times split(begin, end, &runs) over every buffer.
+template <typename Split>
+static void Run(const char* name, const Split& split,
+                const std::vector<std::vector<u8>>& buffers) {
+  using Clock = std::chrono::steady_clock;
+  size_t bytes = 0, runs = 0;
+  auto start = Clock::now();
+  auto elapsed = [&] { return std::chrono::duration<double>(Clock::now() - start).count(); };
+  do {
+    for (const auto& buffer : buffers) {
+      split(buffer.data(), buffer.data() + buffer.size(), &runs);
+      bytes += buffer.size();
+    }
+  } while (elapsed() < 0.5);
+  double seconds = elapsed();
+  printf("  %-10s %8.2f GB/s %8.3f ns/byte (%zu runs)\n", name,
+         bytes / seconds / 1e9, seconds * 1e9 / bytes, runs);
+}
+
+static void Run(const char* name, ScanKernel kernel,
+                const std::vector<std::vector<u8>>& buffers) {
+  Run(name, [&](const u8* p, const u8* end, size_t* runs) {
+    while (p != end) {
+      p = kernel(p, end);
+      ++*runs;
+      if (p != end) ++p;
+    }
+  }, buffers);
+}
+
+int main() {
+  struct { const char* name; int line_length; } corpora[] = {
+    {"short lines (~20 bytes)", 20},
+    {"log lines (~80 bytes)", 80},
+    {"no newlines", 0},
+  };
+  for (const auto& corpus : corpora) {
+    auto buffers = Buffers(corpus.line_length);
+    printf("%s\n", corpus.name);
+    // The corpora are ASCII, so every byte is a rune.
+    NullActions actions;
+    EscapeParser parser(&actions);
+    Run("consume", [&](const u8* p, const u8* end, size_t* runs) {
+      for (; p != end; ++p) {
+        if (!parser.Consume(*p)) PrintRune(*p, runs);
+      }
+    }, buffers);
+    Run("scalar", FindNonPrintableScalar, buffers);
+#if defined(__x86_64__) || defined(__i386__)
+    Run("sse2", FindNonPrintableSSE2, buffers);
+    if (__builtin_cpu_supports("avx2")) Run("avx2", FindNonPrintableAVX2, buffers);
+#endif
+    Run("dispatched", kFindNonPrintable, buffers);
+  }
+}
@@ -4,8 +4,10 @@
 #include "base.h"
 
 #include <array>
+#include <atomic>
 #include <cstring>
 #include <deque>
+#include <sys/uio.h>
 
 template <int N>
 class History {
@@ -69,10 +71,11 @@ class WriteQueue {
     }
   }
 
+  // Drops n bytes, which may span blocks.
   void Shift(int n) {
     start_ += n;
-    if (start_ == N) {
-      start_ = 0;
+    while (start_ >= N) {
+      start_ -= N;
       blocks_.pop_front();
     }
   }
@@ -82,6 +85,17 @@ class WriteQueue {
     *data = &blocks_.front()[start_];
     return blocks_.size() == 1 ? limit_ - start_ : N - start_;
   }
+  // Up to max blocks, for writev(). They stay valid until shifted out.
+  int GetBlocks(iovec* iov, int max) {
+    int count = 0;
+    for (int i = 0; i < blocks_.size() && count < max; ++i) {
+      int begin = i == 0 ? start_ : 0;
+      int end = i + 1 == blocks_.size() ? limit_ : N;
+      if (begin == end) break;
+      iov[count++] = {&blocks_[i][begin], size_t(end - begin)};
+    }
+    return count;
+  }
 
  private:
   std::deque<std::array<u8, N>> blocks_;
@@ -89,4 +103,58 @@ class WriteQueue {
   int limit_ = 0; // in last block
 };
 
+// A ring of N bytes between one producer thread and one consumer thread,
+// without locks. Like WriteQueue, bytes are written and read in place, a
+// contiguous block at a time.
+//
+// Push() and Shift() say when the other side may be waiting for them, so
+// that threads only need to wake each other when the ring was empty or full.
+template <int N>
+class ByteRing {
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+ public:
+  // Producer: the free space that can be written at *data.
+  int GetSpace(u8** data) {
+    u64 head = head_.load(std::memory_order_relaxed);
+    u64 used = head - tail_.load();
+    *data = &data_[head % N];
+    return std::min(N - used, N - head % N);
+  }
+  // Producer: adds n bytes written at GetSpace(). Returns whether the ring
+  // was empty, so that the consumer may be waiting for data.
+  bool Push(int n) {
+    u64 head = head_.load(std::memory_order_relaxed);
+    head_.store(head + n);
+    return tail_.load() == head;
+  }
+
+  // Consumer: the bytes that can be read at *data.
+  int GetBlock(const u8** data) {
+    u64 tail = tail_.load(std::memory_order_relaxed);
+    u64 used = head_.load() - tail;
+    *data = &data_[tail % N];
+    return std::min(used, N - tail % N);
+  }
+  bool HasBlock() const {
+    return head_.load() != tail_.load(std::memory_order_relaxed);
+  }
+  // Consumer: drops n bytes read at GetBlock(). Returns whether the ring
+  // was full, so that the producer may be waiting for space.
+  bool Shift(int n) {
+    u64 tail = tail_.load(std::memory_order_relaxed);
+    tail_.store(tail + n);
+    return head_.load() - tail == N;
+  }
+
+ private:
+  // Each side writes one counter, and reads the other's. The stores and
+  // loads are sequentially consistent, so if both sides store and then
+  // load, at least one sees the other's store: a side can't miss that the
+  // other is about to wait.
+  alignas(64) std::atomic<u64> head_{0};  // Bytes pushed.
+  alignas(64) std::atomic<u64> tail_{0};  // Bytes shifted.
+  alignas(64) u8 data_[N];
+};
+
 #endif // BUFFERS_H_
@@ -1,3 +1,5 @@
 #!/bin/bash
 set -e -x
-clang++ --std=c++1z -o oterm -lutil -lX11 -Wno-switch -O3 $@ *.cc
+clang++ --std=c++1z -o oterm -lutil -lX11 -pthread -Wno-switch -O3 $@ *.cc
+clang++ --std=c++1z -o scan_bench -Wall -Wextra -O3 $@ bench/scan_bench.cc escape_parser.cc scan.cc utf8.cc
+clang++ --std=c++1z -o parser_bench -Wall -Wextra -O3 $@ bench/parser_bench.cc escape_parser.cc scan.cc utf8.cc
@@ -0,0 +1,155 @@
+#ifndef CELL_H_
+#define CELL_H_
+
+#include "base.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Colors are either an index into the 256-color palette, or 24-bit RGB
+// marked by kRGB.
+using Color = u32;
+constexpr Color kRGB = 1 << 24;
+constexpr Color RGBColor(u8 r, u8 g, u8 b) {
+  return kRGB | r << 16 | g << 8 | b;
+}
+
+// How a cell is drawn. Cells refer to styles by an id from the StyleTable.
+struct Style {
+  constexpr static Color kDefaultFg = 7;
+  constexpr static Color kDefaultBg = 0;
+  enum {
+    kBold = 1 << 0,
+    kItalic = 1 << 1,
+    kUnderline = 1 << 2,
+    kInverse = 1 << 3,
+  };
+
+  Color fg = kDefaultFg;
+  Color bg = kDefaultBg;
+  u8 attr = 0;
+
+  bool operator==(const Style& other) const {
+    return fg == other.fg && bg == other.bg && attr == other.attr;
+  }
+  struct Hash {
+    size_t operator()(const Style& s) const {
+      return (size_t(s.fg) * 0x9e3779b1 ^ s.bg) * 0x9e3779b1 ^ s.attr;
+    }
+  };
+};
+
+// Interns styles so that cells store a 32-bit id. Id 0 is the default style.
+// Ids stay valid until Sweep() is told that nothing uses them.
+class StyleTable {
+ public:
+  StyleTable() { Clear(); }
+
+  u32 Intern(const Style& style) {
+    auto it = ids_.find(style);
+    if (LIKELY(it != ids_.end())) return it->second;
+    u32 id = styles_.size();
+    if (!free_.empty()) {
+      id = free_.back();
+      free_.pop_back();
+      styles_[id] = style;
+    } else {
+      styles_.push_back(style);
+    }
+    ids_.emplace(style, id);
+    return id;
+  }
+  const Style& operator[](u32 id) const { return styles_[id]; }
+  // The number of styles in use.
+  size_t size() const { return ids_.size(); }
+  // Ids are less than this.
+  size_t capacity() const { return styles_.size(); }
+
+  // Frees the ids that are not set in live, for reuse by Intern().
+  void Sweep(const std::vector<bool>& live) {
+    for (u32 id = 1; id < styles_.size(); ++id) {
+      if (live[id]) continue;
+      auto it = ids_.find(styles_[id]);
+      if (it == ids_.end() || it->second != id) continue;  // Already free.
+      ids_.erase(it);
+      free_.push_back(id);
+    }
+  }
+
+  void Clear() {
+    styles_.clear();
+    ids_.clear();
+    free_.clear();
+    Intern(Style());
+  }
+
+ private:
+  std::vector<Style> styles_;
+  std::unordered_map<Style, u32, Style::Hash> ids_;
+  std::vector<u32> free_;
+};
+
+// Interns grapheme clusters, i.e. a rune followed by combining marks or
+// joined runes, so that a cell can hold one. Ids are never freed: the table
+// stops growing at kMaxClusters.
+class ClusterTable {
+ public:
+  constexpr static u32 kMaxClusters = 1 << 16;
+  constexpr static u32 kFull = ~u32(0);
+
+  // Returns kFull if the cluster is new and the table is full.
+  u32 Intern(const std::u32string& runes) {
+    auto it = ids_.find(runes);
+    if (it != ids_.end()) return it->second;
+    if (clusters_.size() == kMaxClusters) return kFull;
+    clusters_.push_back(runes);
+    ids_.emplace(runes, clusters_.size() - 1);
+    return clusters_.size() - 1;
+  }
+  const std::u32string& operator[](u32 id) const { return clusters_[id]; }
+
+ private:
+  std::vector<std::u32string> clusters_;
+  std::unordered_map<std::u32string, u32> ids_;
+};
+
+// A character cell, packed into 8 bytes: a codepoint, flags, and a style id.
+struct Cell {
+  enum {
+    // The last cell of a row whose line goes on in the next row.
+    kWrapped = 1 << 0,
+    // The first cell of a double-width character.
+    kWide = 1 << 1,
+    // The second cell of a double-width character, which has no rune.
+    kSpacer = 1 << 2,
+    // The rune is a ClusterTable id: several runes drawn as one.
+    kCluster = 1 << 3,
+  };
+
+  Cell() : rune(0), flags(0), style(0) {}
+  Cell(u32 rune, u32 style) : rune(rune), flags(0), style(style) {}
+  // The cell after a wide character in this style.
+  static Cell Spacer(u32 style) {
+    Cell cell(0, style);
+    cell.flags = kSpacer;
+    return cell;
+  }
+
+  u32 rune : 21;
+  u32 flags : 11;
+  u32 style;
+
+  // The whole cell as one integer, for comparisons.
+  u64 bits() const {
+    u64 result;
+    memcpy(&result, this, sizeof(result));
+    return result;
+  }
+  bool operator==(const Cell& other) const { return bits() == other.bits(); }
+  bool operator!=(const Cell& other) const { return bits() != other.bits(); }
+};
+static_assert(sizeof(Cell) == 8, "Cell should pack into 8 bytes");
+
+#endif // CELL_H_
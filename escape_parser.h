@@ -1,106 +1,360 @@
 #ifndef ESCAPE_PARSER_H_
 #define ESCAPE_PARSER_H_
 
-#include <vector>
+#include <algorithm>
+#include <string>
 
 #include "base.h"
+#include "scan.h"
+#include "utf8.h"
 
-// Parser for terminal escape sequences.
-// Based on the state machine described at http://vt100.net/emu/dec_ansi_parser
-// Pluggable parsers for OSC and DSC are not implemented, strings are passed.
-class EscapeParser {
+// State and types shared by every BasicEscapeParser instantiation.
+class EscapeParserBase {
  public:
-  // Interface for callbacks when we encounter various escape sequences.
-  class Actions {
+  // Numeric parameters of a CSI or DCS sequence, stored inline so that
+  // parsing never allocates. Parameters are separated by ';' and may have
+  // sub-parameters separated by ':', e.g. "1;38:2::255:0:0" is two
+  // parameters, the second with five sub-parameters. Empty values are 0.
+  // Values past kMaxValues (counting sub-parameters) are dropped, and values
+  // are capped at kMaxArgValue.
+  class Args {
    public:
-    virtual ~Actions() = default;
-    virtual void Control(u8 control) = 0;
-    virtual void Escape(const std::string& command) = 0;
-    virtual void CSI(const std::string& command, const std::vector<int>& args) = 0;
-    virtual void DSC(const std::string& command, const std::vector<int>& args, const std::string& payload) = 0;
-    virtual void OSC(const std::string& command) = 0;
+    constexpr static int kMaxValues = 32;
+    constexpr static int kMaxArgValue = 0xffff;
+
+    // The number of parameters.
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // The value of a parameter, before any sub-parameters.
+    int operator[](int index) const { return values_[first_[index]]; }
+    // The number of sub-parameters of a parameter.
+    int sub_size(int index) const {
+      int end = index + 1 < size_ ? first_[index + 1] : values_size_;
+      return end - first_[index] - 1;
+    }
+    int sub(int index, int sub_index) const {
+      return values_[first_[index] + 1 + sub_index];
+    }
+
+   private:
+    friend class EscapeParserBase;
+    void Clear() {
+      size_ = 0;
+      values_size_ = 0;
+    }
+    void Push(bool sub) {
+      // Once full, digits accumulate in the spare slot and are discarded.
+      current_ = values_size_;
+      values_[current_] = 0;
+      if (values_size_ == kMaxValues) return;
+      if (!sub) first_[size_++] = values_size_;
+      ++values_size_;
+    }
+    void Digit(int digit) {
+      int& value = values_[current_];
+      value = std::min(value * 10 + digit, kMaxArgValue);
+    }
+
+    int values_[kMaxValues + 1];
+    u8 first_[kMaxValues];  // Index in values_ of each parameter.
+    u8 size_ = 0;
+    u8 values_size_ = 0;
+    u8 current_ = 0;
   };
 
-  EscapeParser(Actions* actions) : actions_(actions) { Clear(); }
+  // Virtual interface for the callbacks, see EscapeParser.
+  class Actions;
+
+ protected:
+  enum State {
+    GROUND, OSC_STRING, SOS_PM_APC_STRING,
+    ESCAPE, ESCAPE_INTERMEDIATE,
+    CSI_ENTRY, CSI_INTERMEDIATE, CSI_PARAM, CSI_IGNORE,
+    DCS_ENTRY, DCS_INTERMEDIATE, DCS_PARAM, DCS_PASSTHROUGH, DCS_IGNORE,
+    kNumStates,
+  };
+  // What to do with the current character during a transition.
+  enum Action {
+    kNone, kExecute, kCollect, kParam, kOscPut, kDcsPut,
+    kEscDispatch, kCsiDispatch,
+  };
+  // One entry of the state machine: run the current state's exit action,
+  // the transition action, the next state's entry action, and change state.
+  // Entries that stay in the same state run neither exit nor entry actions.
+  struct Transition {
+    u8 action : 4;
+    u8 next : 4;
+    bool exit : 1;
+    bool enter : 1;
+  };
+  // Indexed by state and character, after runes >= 0xa0 are folded to 'A'.
+  struct TransitionTable {
+    Transition entries[kNumStates][0xa0];
+  };
+  // Generated at compile time from the rules in escape_parser.cc.
+  static const TransitionTable kTransitions;
+  friend struct TransitionRules;
+
+  EscapeParserBase() { Clear(); }
+
+  void Param(u8 c);
+  static string_view Text(const u8* begin, const u8* end) {
+    return string_view(reinterpret_cast<const char*>(begin), end - begin);
+  }
+  void Clear() {
+    command_size_ = 0;
+    command_overflow_ = false;
+    args_.Clear();
+  }
+  void Collect(u8 c) {
+    if (LIKELY(command_size_ < kMaxCommand)) {
+      command_[command_size_++] = c;
+    } else {
+      command_overflow_ = true;
+    }
+  }
+  string_view command() const { return string_view(command_, command_size_); }
+
+  // A private marker, up to four intermediates, and the final byte.
+  // Sequences that don't fit are parsed but not dispatched.
+  constexpr static int kMaxCommand = 6;
+
+  State state_ = GROUND;
+  char command_[kMaxCommand];
+  u8 command_size_ = 0;
+  bool command_overflow_ = false;
+  Args args_;
+  UTF8Decoder utf8_;
+};
+
+// Interface for callbacks when we encounter various escape sequences.
+// The command holds the private marker, intermediates and final byte.
+// OSC and DCS strings are streamed: Put() is called with slices of the
+// string between Start/Hook and End/Unhook, often pointing straight into
+// the buffer passed to ConsumeSpan.
+class EscapeParserBase::Actions {
+ public:
+  virtual ~Actions() = default;
+  virtual void Control(u8 control) = 0;
+  virtual void Escape(string_view command) = 0;
+  virtual void CSI(string_view command, const Args& args) = 0;
+  virtual void DCSHook(string_view command, const Args& args) = 0;
+  virtual void DCSPut(string_view data) = 0;
+  virtual void DCSUnhook() = 0;
+  virtual void OSCStart() = 0;
+  virtual void OSCPut(string_view data) = 0;
+  virtual void OSCEnd() = 0;
+};
+
+// Parser for terminal escape sequences.
+// Based on the state machine described at http://vt100.net/emu/dec_ansi_parser
+//
+// ActionsT receives the callbacks and needs the methods of Actions, which
+// are called directly. If it is a final class, they can be inlined into the
+// parser loop.
+template <typename ActionsT>
+class BasicEscapeParser : public EscapeParserBase {
+ public:
+  BasicEscapeParser(ActionsT* actions) : actions_(actions) {}
 
   // Feed the parser a unicode codepoint. Returns false if it should be printed.
   inline bool Consume(u32 rune) {
     if (LIKELY(state_ == GROUND)) {
-      if (LIKELY(rune >= 0x20 && rune < 0x80)) return false;
+      if (LIKELY(rune >= 0x20 && rune < 0x7f)) return false;
       if (rune >= 0xa0) return false;
     }
     Handle(rune);
     return true;
   }
 
- private:
-  enum State {
-    GROUND, OSC_STRING, SOS_PM_APC_STRING,
-    ESCAPE, ESCAPE_INTERMEDIATE,
-    CSI_ENTRY, CSI_INTERMEDIATE, CSI_PARAM, CSI_IGNORE,
-    DCS_ENTRY, DCS_INTERMEDIATE, DCS_PARAM, DCS_PASSTHROUGH, DCS_IGNORE,
-  };
+  // Feed the parser a buffer of UTF-8, handling controls and escapes inline.
+  // Text that should be printed is passed on in runs: printable ASCII as
+  // print(string_view), other characters as print(const u32* runes, int n).
+  // Printable ASCII inside OSC and DCS strings is passed on in runs too.
+  // A UTF-8 sequence split across buffers is completed by the next call.
+  template <typename Print>
+  void ConsumeSpan(const u8* data, size_t size, const Print& print) {
+    const u8* end = data + size;
+    if (UNLIKELY(utf8_.pending())) data = ConsumeUTF8(data, end, print);
+    while (data != end) {
+      if (LIKELY(state_ == GROUND)) {
+        const u8* run = data;
+        data = FindNonPrintable(data, end);
+        if (data != run) print(Text(run, data));
+        if (data == end) return;
+      } else if (state_ == OSC_STRING || state_ == DCS_PASSTHROUGH) {
+        const u8* run = data;
+        data = FindNonPrintable(data, end);
+        if (data != run) Put(Text(run, data));
+        if (data == end) return;
+      }
+      if (UNLIKELY(*data >= 0x80)) {
+        data = ConsumeUTF8(data, end, print);
+      } else {
+        Handle(*data++);
+      }
+    }
+  }
 
+ private:
   void Handle(u32 rune);
-  bool ParamParse(u8 c);
-  void Clear() {
-    command_.clear();
-    payload_.clear();
-    args_.clear();
-    arg_in_progress_ = false;
-  }
-
-  struct Ignore { void operator()() const {} };
-  // Transition to another state.
-  // Runs the exit, transition, and enter actions appropriately.
-  template<typename Action = Ignore>
-  void Transition(State state, const Action& transition_action = Action())
-  __attribute__((always_inline)) {
-    Exit(state_);
-    transition_action();
-    Enter(state);
-    state_ = state;
-  }
-
-  void Enter(State state);
-  void Exit(State state);
-
-  State state_;
-  Actions* actions_;
-  std::string command_;
-  std::string payload_;
-  std::vector<int> args_;
-  bool arg_in_progress_ = false;
+  // Decodes and consumes runes up to the next ASCII byte.
+  template <typename Print>
+  const u8* ConsumeUTF8(const u8* data, const u8* end, const Print& print) {
+    constexpr static int kMaxRunes = 64;
+    u32 runes[kMaxRunes];
+    int count;
+    do {
+      data = utf8_.Decode(data, end, runes, kMaxRunes, &count);
+      // Printable runes are gathered at the start of the array.
+      int printable = 0;
+      for (int i = 0; i < count; ++i) {
+        // As in Consume(), but text before a C1 control must be printed first.
+        if (LIKELY(state_ == GROUND && runes[i] >= 0xa0)) {
+          runes[printable++] = runes[i];
+          continue;
+        }
+        if (printable) print(static_cast<const u32*>(runes), printable);
+        printable = 0;
+        Handle(runes[i]);
+      }
+      if (printable) print(static_cast<const u32*>(runes), printable);
+    } while (count == kMaxRunes);
+    return data;
+  }
+  void Put(string_view data) {
+    if (state_ == OSC_STRING) {
+      actions_->OSCPut(data);
+    } else {
+      actions_->DCSPut(data);
+    }
+  }
+  void Enter();
+  void Exit();
+
+  ActionsT* actions_;
 };
 
+template <typename ActionsT>
+inline void BasicEscapeParser<ActionsT>::Handle(u32 rune) {
+  // Runes past C1 all act as one printable GL character, whatever their
+  // low bits. Strings still get the whole rune.
+  u8 c = rune >= 0xa0 ? 0x41 : rune;
+  Transition transition = kTransitions.entries[state_][c];
+  if (UNLIKELY(transition.exit)) Exit();
+  switch (transition.action) {
+  case kExecute:
+    actions_->Control(c);
+    break;
+  case kCollect:
+    Collect(c);
+    break;
+  case kParam:
+    Param(c);
+    break;
+  case kOscPut:
+  case kDcsPut: {
+    char utf8[4];
+    Put(string_view(utf8, EncodeUTF8(rune, utf8)));
+    break;
+  }
+  case kEscDispatch:
+    Collect(c);
+    if (LIKELY(!command_overflow_)) actions_->Escape(command());
+    break;
+  case kCsiDispatch:
+    Collect(c);
+    if (LIKELY(!command_overflow_)) actions_->CSI(command(), args_);
+    break;
+  }
+  state_ = State(transition.next);
+  if (transition.enter) Enter();
+}
+
+template <typename ActionsT>
+void BasicEscapeParser<ActionsT>::Enter() {
+  switch (state_) {
+  case OSC_STRING:
+    actions_->OSCStart();
+    break;
+  case DCS_PASSTHROUGH:
+    // Without a hook there's nothing to pass the string to.
+    if (UNLIKELY(command_overflow_)) {
+      state_ = DCS_IGNORE;
+      break;
+    }
+    actions_->DCSHook(command(), args_);
+    break;
+  default:
+    Clear();
+    break;
+  }
+}
+
+template <typename ActionsT>
+void BasicEscapeParser<ActionsT>::Exit() {
+  switch (state_) {
+  case OSC_STRING:
+    actions_->OSCEnd();
+    break;
+  case DCS_PASSTHROUGH:
+    actions_->DCSUnhook();
+    break;
+  default:
+    break;
+  }
+}
+
+// The parser for callers of the virtual Actions interface.
+using EscapeParser = BasicEscapeParser<EscapeParserBase::Actions>;
+extern template class BasicEscapeParser<EscapeParserBase::Actions>;
+
 class DebugActions : public EscapeParser::Actions {
  public:
   void Control(u8 control) override {
     fprintf(stdout, "Control(%02x)\n", control);
     fflush(stdout);
   }
-  void Escape(const std::string& command) override {
-    fprintf(stdout, "Esc(%s)\n", command.c_str());
+  void Escape(string_view command) override {
+    fprintf(stdout, "Esc(%.*s)\n", int(command.size()), command.data());
     fflush(stdout);
   }
-  void CSI(const std::string& command, const std::vector<int>& args) override {
-    fprintf(stdout, "CSI(%s, %s)\n", command.c_str(), Join(args).c_str());
+  void CSI(string_view command, const EscapeParser::Args& args) override {
+    fprintf(stdout, "CSI(%.*s, %s)\n", int(command.size()), command.data(),
+            Join(args).c_str());
     fflush(stdout);
   }
-  void DSC(const std::string& command, const std::vector<int>& args, const std::string& payload) override {
-    fprintf(stdout, "DSC(%s, %s, %s)\n", command.c_str(), Join(args).c_str(), payload.c_str());
+  void DCSHook(string_view command, const EscapeParser::Args& args) override {
+    fprintf(stdout, "DCS(%.*s, %s, ", int(command.size()), command.data(),
+            Join(args).c_str());
+  }
+  void DCSPut(string_view data) override {
+    fwrite(data.data(), 1, data.size(), stdout);
+  }
+  void DCSUnhook() override {
+    fprintf(stdout, ")\n");
     fflush(stdout);
   }
-  void OSC(const std::string& command) override {
-    fprintf(stdout, "OSC(%s)\n", command.c_str());
+  void OSCStart() override {
+    fprintf(stdout, "OSC(");
+  }
+  void OSCPut(string_view data) override {
+    fwrite(data.data(), 1, data.size(), stdout);
+  }
+  void OSCEnd() override {
+    fprintf(stdout, ")\n");
     fflush(stdout);
   }
  private:
-  static std::string Join(const std::vector<int>& args) {
+  static std::string Join(const EscapeParser::Args& args) {
     std::string result = "[";
     for (int i = 0; i < args.size(); ++i) {
       if (i) result.push_back(',');
       result.append(std::to_string(args[i]));
+      for (int j = 0; j < args.sub_size(i); ++j) {
+        result.push_back(':');
+        result.append(std::to_string(args.sub(i, j)));
+      }
     }
     result.push_back(']');
     return result;
@@ -0,0 +1,56 @@
+#include "frame.h"
+#include "utf8.h"
+
+#include <cstdio>
+
+static void DumpColor(int layer, Color color) {
+  if (color & kRGB) {
+    fprintf(stderr, "%c[%d;2;%d;%d;%dm", 0x1b, layer,
+        color >> 16 & 0xff, color >> 8 & 0xff, color & 0xff);
+  } else {
+    fprintf(stderr, "%c[%d;5;%dm", 0x1b, layer, color);
+  }
+}
+
+void Frame::Dump() const {
+  if (scrolled >= h) {
+    for (const Row& row : rows) {
+      DumpRow(row);
+      fputc('\n', stderr);
+    }
+    return;
+  }
+  if (scrolled) fprintf(stderr, "Scrolled %d\n", scrolled);
+  for (const Row& row : rows) {
+    fprintf(stderr, "%3d %3d: ", row.y, row.begin);
+    DumpRow(row);
+    fputc('\n', stderr);
+  }
+}
+
+void Frame::DumpRow(const Row& row) const {
+  for (int x = row.begin; x < row.end; ++x) {
+    Cell cell = cells[row.offset + x - row.begin];
+    // The wide character before it covers this cell.
+    if (cell.flags & Cell::kSpacer) continue;
+    const Style& style = styles[cell.style];
+    bool inverse =
+        style.attr & Style::kInverse || (x == cursor_x && row.y == cursor_y);
+    DumpColor(38, inverse ? style.bg : style.fg);
+    DumpColor(48, inverse ? style.fg : style.bg);
+    if (style.attr & Style::kBold) fprintf(stderr, "%c[1m", 0x1b);
+    if (style.attr & Style::kItalic) fprintf(stderr, "%c[3m", 0x1b);
+    if (style.attr & Style::kUnderline) fprintf(stderr, "%c[4m", 0x1b);
+    char utf8[4];
+    if (cell.flags & Cell::kCluster) {
+      for (u32 rune : clusters[cell.rune]) {
+        fwrite(utf8, 1, EncodeUTF8(rune, utf8), stderr);
+      }
+    } else if (cell.rune < 0x20 || cell.rune == 0x7f) {
+      fputc(' ', stderr);
+    } else {
+      fwrite(utf8, 1, EncodeUTF8(cell.rune, utf8), stderr);
+    }
+    fprintf(stderr, "%c[0m", 0x1b);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include "base.h"
+#include "cell.h"
+
+#include <string>
+#include <vector>
+
+// A copy of what changed in a Grid, to be drawn on another thread while the
+// grid goes on changing. A frame owns everything its cells refer to: style
+// ids index styles, and cluster ids index clusters, not the grid's tables.
+struct Frame {
+  // Columns [begin, end) of row y, which are cells[offset, offset + end -
+  // begin). Columns past the end of the row are blank.
+  struct Row {
+    int y, begin, end;
+    size_t offset;
+  };
+
+  int w = 0, h = 0;
+  int cursor_x = 0, cursor_y = 0;
+  // As in Damage: if it is at least h, every row is in rows.
+  int scrolled = 0;
+  std::vector<Row> rows;
+  std::vector<Cell> cells;
+  std::vector<Style> styles;
+  std::vector<std::u32string> clusters;
+  size_t scrollback_lines = 0;
+  size_t scrollback_bytes = 0;
+
+  bool empty() const { return scrolled == 0 && rows.empty(); }
+
+  // Writes the changed rows to stderr.
+  void Dump() const;
+
+ private:
+  void DumpRow(const Row& row) const;
+};
+
+#endif // FRAME_H_
@@ -0,0 +1,4 @@
+#!/bin/bash
+set -e -x
+clang++ --std=c++1z -o parser_fuzz -g -O1 -fsanitize=fuzzer,address,undefined $@ fuzz/parser_fuzz.cc escape_parser.cc scan.cc utf8.cc
+clang++ --std=c++1z -o grid_fuzz -g -O1 -fsanitize=fuzzer,address,undefined $@ fuzz/grid_fuzz.cc grid.cc scrollback.cc width.cc frame.cc utf8.cc
@@ -0,0 +1,401 @@
+// Fuzzer for Grid's damage tracking and rewrapping.
+// The input is a grid size and then a script of operations. A shadow
+// screen is kept up to date only from the damage the grid reports, through
+// TakeDamage() or TakeFrame(), and must then match the grid everywhere,
+// including the cell under the cursor.
+//
+// Resizing to a narrower width and back must keep the text, as lines of
+// scrollback and screen, and the rows on the screen must be wrapped as
+// Put() would wrap them. The cursor keeps its place in the text too,
+// unless the rows below it didn't fit on the screen.
+//
+// Build and run with clang (see fuzz.sh):
+//   ./grid_fuzz -max_len=4096 corpus/
+// Or build with -DSTANDALONE_FUZZ_MAIN to replay inputs given as arguments.
+
+#include "../frame.h"
+#include "../grid.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Reads the script, and then zeros once it runs out.
+class Script {
+ public:
+  Script(const u8* data, size_t size) : data_(data), end_(data + size) {}
+  bool done() const { return data_ == end_; }
+  u8 Next() { return data_ == end_ ? 0 : *data_++; }
+
+ private:
+  const u8* data_;
+  const u8* end_;
+};
+
+// What a cell looks like, independent of the tables its ids refer to.
+struct Shadow {
+  std::u32string runes;
+  Style style;
+  u32 flags = 0;
+  bool cursor = false;
+
+  bool operator==(const Shadow& other) const {
+    return runes == other.runes && style == other.style &&
+           flags == other.flags && cursor == other.cursor;
+  }
+};
+using Screen = std::vector<std::vector<Shadow>>;
+
+// The wrapped flag isn't drawn, and cluster ids are in runes.
+constexpr u32 kDrawnFlags = Cell::kWide | Cell::kSpacer;
+
+static Shadow FromGrid(Grid& grid, int x, int y) {
+  Cell cell = grid.cell(x, y);
+  Shadow shadow;
+  shadow.runes = cell.flags & Cell::kCluster ? grid.cluster(cell.rune)
+                                             : std::u32string(1, cell.rune);
+  shadow.style = grid.style(cell.style);
+  shadow.flags = cell.flags & kDrawnFlags;
+  shadow.cursor = x == grid.x() && y == grid.y();
+  return shadow;
+}
+
+static Shadow FromFrame(const Frame& frame, Cell cell, int x, int y) {
+  Shadow shadow;
+  shadow.runes = cell.flags & Cell::kCluster ? frame.clusters[cell.rune]
+                                             : std::u32string(1, cell.rune);
+  shadow.style = frame.styles[cell.style];
+  shadow.flags = cell.flags & kDrawnFlags;
+  shadow.cursor = x == frame.cursor_x && y == frame.cursor_y;
+  return shadow;
+}
+
+static void Fail(const char* what, int x, int y) {
+  fprintf(stderr, "%s at %d,%d\n", what, x, y);
+  abort();
+}
+
+// Moves the shadow screen up as the grid scrolled. The cursor column is
+// included, as the cursor may sit just past the last column.
+static void Scroll(Screen* screen, int w, int h, int scrolled) {
+  if (scrolled >= h || screen->size() != h) {
+    screen->assign(h, std::vector<Shadow>(w + 1));
+    return;
+  }
+  for (int y = 0; y + scrolled < h; ++y) (*screen)[y] = (*screen)[y + scrolled];
+}
+
+static void Check(Grid& grid, const Screen& screen) {
+  for (int y = 0; y < grid.h(); ++y) {
+    for (int x = 0; x <= grid.w(); ++x) {
+      if (!(screen[y][x] == FromGrid(grid, x, y))) Fail("Stale cell", x, y);
+    }
+  }
+}
+
+static void TakeDamage(Grid* grid, Screen* screen) {
+  Damage damage;
+  grid->TakeDamage(&damage);
+  Scroll(screen, grid->w(), grid->h(), damage.scrolled);
+  if (damage.scrolled >= grid->h()) {
+    for (int y = 0; y < grid->h(); ++y) damage.rows.push_back({y, 0, grid->w() + 1});
+  }
+  for (const auto& row : damage.rows) {
+    if (row.y < 0 || row.y >= grid->h()) Fail("Damaged row out of range", 0, row.y);
+    for (int x = row.begin; x < std::min(row.end, grid->w() + 1); ++x) {
+      (*screen)[row.y][x] = FromGrid(*grid, x, row.y);
+    }
+  }
+  Check(*grid, *screen);
+}
+
+static void TakeFrame(Grid* grid, Screen* screen) {
+  Frame frame;
+  grid->TakeFrame(&frame);
+  if (frame.w != grid->w() || frame.h != grid->h()) Fail("Frame size", frame.w, frame.h);
+  Scroll(screen, frame.w, frame.h, frame.scrolled);
+  for (const auto& row : frame.rows) {
+    if (row.y < 0 || row.y >= frame.h) Fail("Frame row out of range", 0, row.y);
+    for (int x = row.begin; x < row.end; ++x) {
+      (*screen)[row.y][x] =
+          FromFrame(frame, frame.cells[row.offset + x - row.begin], x, row.y);
+    }
+  }
+  Check(*grid, *screen);
+}
+
+// The text of a grid, which rewrapping must not change.
+struct Text {
+  std::vector<std::vector<Cell>> lines;  // Without kWrapped.
+  int cursor_line = 0;  // Counted back from the last line.
+  int cursor_offset = 0;
+
+  bool operator==(const Text& other) const {
+    return lines == other.lines && cursor_line == other.cursor_line &&
+           cursor_offset == other.cursor_offset;
+  }
+};
+
+static void TrimBlanks(std::vector<Cell>* cells) {
+  while (!cells->empty() && cells->back() == Cell()) cells->pop_back();
+}
+
+// The cells of a screen row, up to its wrapped last cell, or else up to its
+// last cell that isn't blank.
+static std::vector<Cell> RowCells(Grid& grid, int y) {
+  std::vector<Cell> row;
+  for (int x = 0; x < grid.w(); ++x) {
+    row.push_back(grid.cell(x, y));
+    if (row.back().flags & Cell::kWrapped) return row;
+  }
+  TrimBlanks(&row);
+  return row;
+}
+
+static bool Wrapped(const std::vector<Cell>& row) {
+  return !row.empty() && row.back().flags & Cell::kWrapped;
+}
+
+// Rows below the cursor and the last row with text are padding, even if
+// they are wrapped.
+static int LastRow(Grid& grid) {
+  int last = grid.y();
+  for (int y = grid.y() + 1; y < grid.h(); ++y) {
+    for (int x = 0; x < grid.w(); ++x) {
+      Cell cell = grid.cell(x, y);
+      cell.flags &= ~Cell::kWrapped;
+      if (cell != Cell()) last = y;
+    }
+  }
+  return last;
+}
+
+static Text GetText(Grid& grid) {
+  Text text;
+  std::vector<Cell> line;
+  size_t lines = grid.scrollback().size();
+  if (grid.scrollback().partial()) --lines;
+  for (size_t i = 0; i < lines; ++i) {
+    text.lines.emplace_back();
+    grid.scrollback().Line(i, &text.lines.back());
+    TrimBlanks(&text.lines.back());
+  }
+  // The rest of a line that began in the scrollback.
+  if (lines < grid.scrollback().size()) grid.scrollback().Line(lines, &line);
+  int cursor_line = -1;
+  for (int y = 0, last = LastRow(grid); y <= last; ++y) {
+    std::vector<Cell> row = RowCells(grid, y);
+    if (y == grid.y()) {
+      cursor_line = text.lines.size();
+      text.cursor_offset = line.size() + grid.x();
+    }
+    line.insert(line.end(), row.begin(), row.end());
+    if (Wrapped(row) && y < last) continue;
+    for (Cell& cell : line) cell.flags &= ~Cell::kWrapped;
+    TrimBlanks(&line);
+    text.lines.push_back(std::move(line));
+    line.clear();
+  }
+  // Empty lines below the cursor are padding too, once they lose the wrapped
+  // flag that kept them, and so may be empty lines at the top.
+  while (text.lines.size() > cursor_line + 1 && text.lines.back().empty()) {
+    text.lines.pop_back();
+  }
+  text.cursor_line = text.lines.size() - 1 - cursor_line;
+  size_t empty = 0;
+  while (empty < text.lines.size() && text.lines[empty].empty()) ++empty;
+  text.lines.erase(text.lines.begin(), text.lines.begin() + empty);
+  return text;
+}
+
+// Rows are wrapped after the last column, or before a wide character that
+// doesn't fit.
+static void CheckWrapped(Grid& grid) {
+  for (int y = 0, last = LastRow(grid); y < last; ++y) {
+    std::vector<Cell> row = RowCells(grid, y);
+    if (!Wrapped(row)) continue;
+    Cell next = grid.cell(0, y + 1);
+    bool before_wide = grid.w() > 1 && next.flags & Cell::kWide;
+    if (row.size() != grid.w() && !(before_wide && row.size() == grid.w() - 1)) {
+      Fail("Wrapped short of the last column", row.size(), y);
+    }
+  }
+}
+
+// If the rows below the cursor didn't fit, the cursor was moved to the top
+// left. Otherwise it must still be in its place in the text.
+static bool MaybeMoved(Grid& grid) {
+  return grid.y() == 0 && LastRow(grid) == grid.h() - 1;
+}
+
+// Resizes to a narrower width and back.
+static void Rewrap(Grid* grid, int narrow) {
+  Text text = GetText(*grid);
+  int w = grid->w();
+  grid->Resize(narrow, grid->h());
+  Text narrowed = GetText(*grid);
+  if (narrowed.lines != text.lines) Fail("Text changed by narrowing", narrow, 0);
+  if (!MaybeMoved(*grid) && !(narrowed == text)) {
+    Fail("Cursor moved by narrowing", grid->x(), grid->y());
+  }
+  CheckWrapped(*grid);
+  bool moved = MaybeMoved(*grid);
+  grid->Resize(w, grid->h());
+  Text widened = GetText(*grid);
+  if (widened.lines != text.lines) Fail("Text changed by widening", w, 0);
+  if (!moved && !MaybeMoved(*grid) && !(widened == text)) {
+    Fail("Cursor moved by widening", grid->x(), grid->y());
+  }
+  CheckWrapped(*grid);
+}
+
+// Runes of each width, and ones that join the character before them.
+constexpr u32 kRunes[] = {
+    U'a', U'Z', 0xe9, 0x4e2d, 0xac00, 0x1f600, 0x301, 0x200d, 0xfe0f,
+};
+
+static void Run(Grid* grid, Script* script, Screen* screen) {
+  std::vector<u32> styles = {0};
+  while (!script->done()) {
+    u8 op = script->Next();
+    u8 arg = script->Next();
+    u32 style = styles[arg % styles.size()];
+    switch (op % 25) {
+    case 0:
+    case 1:
+      grid->Put(Cell('a' + arg % 26, style));
+      break;
+    case 2:
+    case 3:
+      grid->Put(std::string(arg % 40, 'a' + op % 26), style);
+      break;
+    case 4:
+    case 5: {
+      std::vector<u32> runes;
+      for (int i = arg % 8; i; --i) {
+        runes.push_back(kRunes[script->Next() % (sizeof(kRunes) / sizeof(*kRunes))]);
+      }
+      grid->Put(runes.data(), runes.size(), style);
+      break;
+    }
+    case 6:
+      grid->CarriageReturn();
+      break;
+    case 7:
+      grid->LineFeed();
+      break;
+    case 8:
+      grid->ReverseLineFeed();
+      break;
+    case 9:
+      grid->Move(arg % grid->w(), script->Next() % grid->h());
+      break;
+    case 10:
+      grid->PutBackwards(Cell());
+      break;
+    case 11:
+      grid->Tab(Cell(' ', style));
+      break;
+    case 12:
+      grid->ClearLine(arg % grid->h());
+      break;
+    case 13:
+      grid->ClearAroundCursor(arg % 2);
+      break;
+    case 14:
+      grid->SetScrollRegion(arg % grid->h(), script->Next() % (grid->h() + 1));
+      break;
+    case 15:
+      grid->Scroll(int(arg % 7) - 3);
+      break;
+    case 16:
+      grid->InsertLines(1 + arg % 4);
+      break;
+    case 17:
+      grid->DeleteLines(1 + arg % 4);
+      break;
+    case 18:
+      if (arg % 8 == 0) grid->Reset();
+      break;
+    case 19:
+      grid->Resize(1 + arg % 40, 1 + script->Next() % 16);
+      break;
+    case 20: {
+      Style added;
+      added.fg = arg;
+      added.attr = script->Next() % 16;
+      styles.push_back(grid->Intern(added));
+      break;
+    }
+    case 21:
+      grid->TouchAll();
+      break;
+    case 22:
+      TakeDamage(grid, screen);
+      break;
+    case 23:
+      TakeFrame(grid, screen);
+      break;
+    case 24:
+      if (grid->w() > 1) Rewrap(grid, 1 + arg % (grid->w() - 1));
+      break;
+    }
+  }
+  TakeFrame(grid, screen);
+}
+
+// A joiner at the end of a row joined the next rune to nothing once the
+// cursor moved to the start of a row, and the rune was lost.
+static void CheckJoiner(bool end_cluster) {
+  Grid grid(10, 2);
+  const u32 joined[] = {U'a', 0x200d};
+  grid.Put(joined, 2, 0);
+  if (end_cluster) {
+    grid.EndCluster();
+  } else {
+    grid.CarriageReturn();
+    grid.LineFeed();
+  }
+  int x = grid.x();
+  const u32 wide[] = {0x4e2d};
+  grid.Put(wide, 1, 0);
+  Cell cell = grid.cell(x, grid.y());
+  if (cell.rune != 0x4e2d || !(cell.flags & Cell::kWide)) {
+    Fail("Joined after the cluster ended", x, grid.y());
+  }
+}
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+  CheckJoiner(/*end_cluster=*/false);
+  CheckJoiner(/*end_cluster=*/true);
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8* data, size_t size) {
+  Script script(data, size);
+  Grid grid(1 + script.Next() % 40, 1 + script.Next() % 16);
+  Screen screen;
+  TakeDamage(&grid, &screen);
+  Run(&grid, &script, &screen);
+  return 0;
+}
+
+#ifdef STANDALONE_FUZZ_MAIN
+int main(int argc, char** argv) {
+  LLVMFuzzerInitialize(&argc, &argv);
+  for (int i = 1; i < argc; ++i) {
+    FILE* file = fopen(argv[i], "rb");
+    if (!file) {
+      fprintf(stderr, "can't read %s\n", argv[i]);
+      return 1;
+    }
+    std::string input;
+    char buf[4096];
+    while (size_t n = fread(buf, 1, sizeof(buf), file)) input.append(buf, n);
+    fclose(file);
+    LLVMFuzzerTestOneInput(reinterpret_cast<const u8*>(input.data()), input.size());
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,207 @@
+// Differential fuzzer for EscapeParser.
+// The reference is the switch-based parser that the transition table
+// replaced (reference_parser.h), driven the simplest way: decode UTF-8 one
+// byte at a time and Consume() each rune. The same input is then fed to
+// EscapeParser, which must produce the same actions:
+//  - Consume() each rune, as the reference is driven,
+//  - ConsumeSpan over the whole input, through virtual and direct actions,
+//  - ConsumeSpan over the input split at fuzzer-chosen points, as read() can,
+//  - each FindNonPrintable kernel, which must agree with the scalar one.
+//
+// Build and run with clang (see fuzz.sh):
+//   ./parser_fuzz -max_len=4096 corpus/
+// Or build with -DSTANDALONE_FUZZ_MAIN to replay inputs given as arguments.
+
+#include "../escape_parser.h"
+#include "reference_parser.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Records actions as text. Printed text and string contents are merged
+// across calls, since the fast paths pass them on in larger pieces.
+class RecordingActions final : public EscapeParser::Actions,
+                               public ReferenceActions {
+ public:
+  void Control(u8 control) override { Event("Control", std::to_string(control)); }
+  void Escape(string_view command) override { Event("Esc", command); }
+  void CSI(string_view command, const EscapeParser::Args& args) override {
+    Event("CSI", std::string(command) + Join(args));
+  }
+  void DCSHook(string_view command, const EscapeParser::Args& args) override {
+    Event("DCSHook", std::string(command) + Join(args));
+  }
+  void DCSPut(string_view data) override { Text("DCSPut", data); }
+  void DCSUnhook() override { Event("DCSUnhook", ""); }
+  void OSCStart() override { Event("OSCStart", ""); }
+  void OSCPut(string_view data) override { Text("OSCPut", data); }
+  void OSCEnd() override { Event("OSCEnd", ""); }
+
+  void Print(string_view text) { Text("Print", text); }
+  void Print(const u32* runes, int count) {
+    for (int i = 0; i < count; ++i) {
+      char utf8[4];
+      Text("Print", string_view(utf8, EncodeUTF8(runes[i], utf8)));
+    }
+  }
+
+  const std::string& log() const { return log_; }
+
+  void Event(const char* name, string_view detail) override {
+    log_.append("\n").append(name).append("(");
+    log_.append(detail.data(), detail.size()).append(")");
+    last_text_ = nullptr;
+  }
+  void Text(const char* name, string_view text) override {
+    if (last_text_ != name) Event(name, "");
+    log_.pop_back();  // The closing paren.
+    log_.append(text.data(), text.size()).append(")");
+    last_text_ = name;
+  }
+
+ private:
+  static std::string Join(const EscapeParser::Args& args) {
+    std::string result;
+    for (int i = 0; i < args.size(); ++i) {
+      result.append(i ? ";" : " ").append(std::to_string(args[i]));
+      for (int j = 0; j < args.sub_size(i); ++j)
+        result.append(":").append(std::to_string(args.sub(i, j)));
+    }
+    return result;
+  }
+
+  std::string log_;
+  const char* last_text_ = nullptr;
+};
+
+static string_view AsText(const u8* data, size_t size) {
+  return string_view(reinterpret_cast<const char*>(data), size);
+}
+
+// Decodes UTF-8 one byte at a time, and feeds each rune to Consume().
+template <typename Parser>
+static std::string Runes(const u8* data, size_t size) {
+  RecordingActions actions;
+  Parser parser(&actions);
+  UTF8Decoder decoder;
+  for (size_t i = 0; i < size; ++i) {
+    const u8 *p = &data[i], *end = p + 1;
+    while (p != end) {
+      if (!decoder.pending() && *p < 0x80) {
+        if (!parser.Consume(*p)) actions.Print(AsText(p, 1));
+        ++p;
+        continue;
+      }
+      u32 runes[4];
+      int count;
+      p = decoder.Decode(p, end, runes, 4, &count);
+      for (int j = 0; j < count; ++j) {
+        if (!parser.Consume(runes[j])) actions.Print(&runes[j], 1);
+      }
+    }
+  }
+  return actions.log();
+}
+
+// Splits the input into chunks with sizes from a PRNG seeded by split_seed,
+// or passes it whole if the seed is 0.
+template <typename Parser>
+static std::string Span(const u8* data, size_t size, u8 split_seed) {
+  RecordingActions actions;
+  Parser parser(&actions);
+  auto print = [&](auto... text) { actions.Print(text...); };
+  u32 state = split_seed;
+  while (size) {
+    size_t chunk = size;
+    if (split_seed) {
+      state = state * 1103515245 + 12345;
+      chunk = std::min<size_t>(size, (state >> 16) % 17);
+    }
+    parser.ConsumeSpan(data, chunk, print);
+    data += chunk;
+    size -= chunk;
+  }
+  return actions.log();
+}
+
+static void Check(const char* variant, const std::string& expected,
+                  const std::string& actual) {
+  if (expected == actual) return;
+  fprintf(stderr, "%s differs from the reference.\nReference:%s\n\n%s:%s\n",
+          variant, expected.c_str(), variant, actual.c_str());
+  abort();
+}
+
+static void CheckKernels(const u8* data, size_t size) {
+  const u8* end = data + size;
+  for (const u8* p = data; p < end; p += 7) {
+    const u8* expected = FindNonPrintableScalar(p, end);
+#if defined(__x86_64__) || defined(__i386__)
+    if (FindNonPrintableSSE2(p, end) != expected) Check("SSE2", "", "mismatch");
+    if (__builtin_cpu_supports("avx2") && FindNonPrintableAVX2(p, end) != expected)
+      Check("AVX2", "", "mismatch");
+#endif
+  }
+}
+
+// Inputs with known actions, checked before any fuzzing.
+struct Regression {
+  const char* input;
+  const char* expected;
+};
+constexpr Regression kRegressions[] = {
+    // Runes past U+00FF were folded onto C0 controls and ASCII, so these
+    // ended strings early or dispatched escapes.
+    {"\x1b]0;t\xc4\x9bst\x07", "\nOSCStart()\nOSCPut(0;t\xc4\x9bst)\nOSCEnd()"},
+    {"\x1b]0;\xc4\x87x\x07", "\nOSCStart()\nOSCPut(0;\xc4\x87x)\nOSCEnd()"},
+    {"\x1b]0;\xc4\x80x\x07", "\nOSCStart()\nOSCPut(0;\xc4\x80x)\nOSCEnd()"},
+    {"\x1bP1|\xc4\x9b\xc4\x87\xc4\x80\x1b\\",
+     "\nDCSHook(| 1)\nDCSPut(\xc4\x9b\xc4\x87\xc4\x80)\nDCSUnhook()\nEsc(\\)"},
+};
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+  for (const Regression& regression : kRegressions) {
+    const u8* data = reinterpret_cast<const u8*>(regression.input);
+    size_t size = strlen(regression.input);
+    Check("Reference", regression.expected, Runes<ReferenceParser>(data, size));
+    Check("ConsumeSpan", regression.expected, Span<EscapeParser>(data, size, 0));
+  }
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8* data, size_t size) {
+  if (size == 0) return 0;
+  u8 split_seed = data[0];
+  ++data;
+  --size;
+  std::string expected = Runes<ReferenceParser>(data, size);
+  Check("Consume", expected, Runes<EscapeParser>(data, size));
+  Check("ConsumeSpan", expected, Span<EscapeParser>(data, size, 0));
+  Check("ConsumeSpan (direct)", expected,
+        Span<BasicEscapeParser<RecordingActions>>(data, size, 0));
+  Check("ConsumeSpan (split)", expected,
+        Span<BasicEscapeParser<RecordingActions>>(data, size, split_seed | 1));
+  CheckKernels(data, size);
+  return 0;
+}
+
+#ifdef STANDALONE_FUZZ_MAIN
+int main(int argc, char** argv) {
+  LLVMFuzzerInitialize(&argc, &argv);
+  for (int i = 1; i < argc; ++i) {
+    FILE* file = fopen(argv[i], "rb");
+    if (!file) {
+      fprintf(stderr, "can't read %s\n", argv[i]);
+      return 1;
+    }
+    std::string input;
+    char buf[4096];
+    while (size_t n = fread(buf, 1, sizeof(buf), file)) input.append(buf, n);
+    fclose(file);
+    LLVMFuzzerTestOneInput(reinterpret_cast<const u8*>(input.data()), input.size());
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,263 @@
+#ifndef FUZZ_REFERENCE_PARSER_H_
+#define FUZZ_REFERENCE_PARSER_H_
+
+// The switch-based EscapeParser from before the transition table, kept as
+// a reference for the fuzzer. It shares no code with the parser under
+// test: parameters, intermediates and dispatch are all done here.
+//
+// It has the fixes made since, which the table must match too:
+//  - Only 0x3c-0x3f are private markers, and a DCS with one stays a DCS.
+//  - Parameters are limited and split into sub-parameters as in Args.
+//  - The command is limited to kMaxCommand, and is not dispatched (or the
+//    DCS is ignored) if it overflows.
+//  - OSC and DCS strings are streamed, and the DCS final byte is part of
+//    the hook command. BEL ends an OSC string.
+//  - Runes >= 0xa0 all act as one printable character.
+//  - DEL is ignored in GROUND.
+
+#include "../escape_parser.h"
+
+#include <string>
+#include <vector>
+
+// Called as the parser's actions are, but with the parameters already
+// written out as text.
+class ReferenceActions {
+ public:
+  virtual ~ReferenceActions() = default;
+  virtual void Event(const char* name, string_view detail) = 0;
+  virtual void Text(const char* name, string_view text) = 0;
+};
+
+class ReferenceParser {
+ public:
+  ReferenceParser(ReferenceActions* actions) : actions_(actions) { Clear(); }
+
+  // Feed the parser a unicode codepoint. Returns false if it should be printed.
+  bool Consume(u32 rune) {
+    if (state_ == GROUND) {
+      if (rune >= 0x20 && rune < 0x7f) return false;
+      if (rune >= 0xa0) return false;
+    }
+    Handle(rune);
+    return true;
+  }
+
+ private:
+  enum State {
+    GROUND, OSC_STRING, SOS_PM_APC_STRING,
+    ESCAPE, ESCAPE_INTERMEDIATE,
+    CSI_ENTRY, CSI_INTERMEDIATE, CSI_PARAM, CSI_IGNORE,
+    DCS_ENTRY, DCS_INTERMEDIATE, DCS_PARAM, DCS_PASSTHROUGH, DCS_IGNORE,
+  };
+  constexpr static int kMaxCommand = 6;
+  constexpr static int kMaxValues = EscapeParser::Args::kMaxValues;
+  constexpr static int kMaxArgValue = EscapeParser::Args::kMaxArgValue;
+
+  void Handle(u32 rune) {
+    u8 c = rune >= 0xa0 ? 0x41 : rune;
+    // Some characters are handled the same way in all modes.
+    switch (c) {
+    case 0x1B:
+      return Transition(ESCAPE);
+    case 0x90:
+      return Transition(DCS_ENTRY);
+    case 0x9B:
+      return Transition(CSI_ENTRY);
+    case 0x9C:
+      return Transition(GROUND);
+    case 0x9D:
+      return Transition(OSC_STRING);
+    case 0x98: case 0x9E: case 0x9F:
+      return Transition(SOS_PM_APC_STRING);
+    case 0x18: case 0x1A:
+    case 0x80: case 0x81: case 0x82: case 0x83:
+    case 0x84: case 0x85: case 0x86: case 0x87:
+    case 0x88: case 0x89: case 0x8a: case 0x8b:
+    case 0x8c: case 0x8d: case 0x8e: case 0x8f:
+    case 0x91: case 0x92: case 0x93: case 0x94:
+    case 0x95: case 0x96: case 0x97: case 0x99: case 0x9a:
+      return Transition(GROUND, [&]{ Control(c); });
+    case 0x7f:
+      if (state_ != OSC_STRING) return;
+    }
+    // C0 control characters (not handled above) have uniform rules per state.
+    if (c < 0x20) {
+      switch (state_) {
+      case GROUND: case ESCAPE: case ESCAPE_INTERMEDIATE:
+      case CSI_ENTRY: case CSI_INTERMEDIATE: case CSI_PARAM: case CSI_IGNORE:
+        return Control(c);
+      case DCS_PASSTHROUGH:
+        return Put("DCSPut", rune);
+      case OSC_STRING:
+        if (c == 0x07) return Transition(GROUND);
+        return;
+      default:
+        return;
+      }
+    }
+    switch (state_) {
+    case GROUND:
+      return;
+    case ESCAPE:
+      switch (c) {
+      case 0x50:
+        return Transition(DCS_ENTRY);
+      case 0x5B:
+        return Transition(CSI_ENTRY);
+      case 0x58: case 0x5E: case 0x5F:
+        return Transition(SOS_PM_APC_STRING);
+      case 0x5D:
+        return Transition(OSC_STRING);
+      }
+    /* fallthrough */
+    case ESCAPE_INTERMEDIATE:
+      if (c < 0x30) return Transition(ESCAPE_INTERMEDIATE, [&]{ Collect(c); });
+      return Transition(GROUND, [&]{
+        Collect(c);
+        if (!command_overflow_) actions_->Event("Esc", command_);
+      });
+    case CSI_ENTRY:
+      if (c >= 0x3c && c < 0x40) return Transition(CSI_PARAM, [&]{
+        Collect(c);
+      });
+      /* fallthrough */
+    case CSI_PARAM:
+      if (ParamParse(c)) return Transition(CSI_PARAM);
+      /* fallthrough */
+    case CSI_INTERMEDIATE:
+      if (c >= 0x40) return Transition(GROUND, [&]{
+        Collect(c);
+        if (!command_overflow_) actions_->Event("CSI", command_ + Join());
+      });
+      if (c < 0x30) return Transition(CSI_INTERMEDIATE, [&]{ Collect(c); });
+      return Transition(CSI_IGNORE);
+    case CSI_IGNORE:
+      if (c >= 0x40) return Transition(GROUND);
+      return;
+    case DCS_ENTRY:
+      if (c >= 0x3c && c < 0x40) return Transition(DCS_PARAM, [&]{
+        Collect(c);
+      });
+      /* fallthrough */
+    case DCS_PARAM:
+      if (ParamParse(c)) return Transition(DCS_PARAM);
+      /* fallthrough */
+    case DCS_INTERMEDIATE:
+      if (c >= 0x40) return Transition(DCS_PASSTHROUGH, [&]{ Collect(c); });
+      if (c < 0x30) return Transition(DCS_INTERMEDIATE, [&]{ Collect(c); });
+      return Transition(DCS_IGNORE);
+    case DCS_PASSTHROUGH:
+      return Put("DCSPut", rune);
+    case DCS_IGNORE:
+      return;
+    case OSC_STRING:
+      return Put("OSCPut", rune);
+    case SOS_PM_APC_STRING:
+      return;
+    }
+  }
+
+  void Control(u8 c) { actions_->Event("Control", std::to_string(c)); }
+  void Put(const char* name, u32 rune) {
+    char utf8[4];
+    actions_->Text(name, string_view(utf8, EncodeUTF8(rune, utf8)));
+  }
+  void Collect(u8 c) {
+    if (command_.size() < kMaxCommand) {
+      command_.push_back(c);
+    } else {
+      command_overflow_ = true;
+    }
+  }
+
+  // ';' starts a parameter and ':' a sub-parameter. The first parameter
+  // starts with the first parameter character.
+  bool ParamParse(u8 c) {
+    if (c != ';' && c != ':' && (c < '0' || c > '9')) return false;
+    if (params_.empty()) PushValue(/*sub=*/false);
+    if (c == ';' || c == ':') {
+      PushValue(/*sub=*/c == ':');
+    } else if (value_) {
+      *value_ = std::min(*value_ * 10 + c - '0', kMaxArgValue);
+    }
+    return true;
+  }
+  void PushValue(bool sub) {
+    // Values past kMaxValues are dropped, digits and all.
+    value_ = nullptr;
+    if (values_ == kMaxValues) return;
+    ++values_;
+    if (!sub) params_.emplace_back();
+    params_.back().push_back(0);
+    value_ = &params_.back().back();
+  }
+  std::string Join() const {
+    std::string result;
+    for (size_t i = 0; i < params_.size(); ++i) {
+      result.append(i ? ";" : " ").append(std::to_string(params_[i][0]));
+      for (size_t j = 1; j < params_[i].size(); ++j)
+        result.append(":").append(std::to_string(params_[i][j]));
+    }
+    return result;
+  }
+
+  void Clear() {
+    command_.clear();
+    command_overflow_ = false;
+    params_.clear();
+    values_ = 0;
+    value_ = nullptr;
+  }
+
+  struct Ignore { void operator()() const {} };
+  // Transition to another state.
+  // Runs the exit, transition, and enter actions appropriately.
+  template <typename Action = Ignore>
+  void Transition(State state, const Action& transition_action = Action()) {
+    Exit();
+    transition_action();
+    state_ = state;
+    Enter();
+  }
+
+  void Enter() {
+    switch (state_) {
+    case ESCAPE:
+    case DCS_ENTRY:
+    case CSI_ENTRY:
+      return Clear();
+    case OSC_STRING:
+      return actions_->Event("OSCStart", "");
+    case DCS_PASSTHROUGH:
+      if (command_overflow_) {
+        state_ = DCS_IGNORE;
+        return;
+      }
+      return actions_->Event("DCSHook", command_ + Join());
+    default:
+      return;
+    }
+  }
+
+  void Exit() {
+    switch (state_) {
+    case OSC_STRING:
+      return actions_->Event("OSCEnd", "");
+    case DCS_PASSTHROUGH:
+      return actions_->Event("DCSUnhook", "");
+    default:
+      return;
+    }
+  }
+
+  State state_ = GROUND;
+  ReferenceActions* actions_;
+  std::string command_;
+  bool command_overflow_ = false;
+  std::vector<std::vector<int>> params_;
+  int values_ = 0;  // Including sub-parameters.
+  int* value_ = nullptr;  // Where digits go, if anywhere.
+};
+
+#endif // FUZZ_REFERENCE_PARSER_H_
@@ -0,0 +1,297 @@
+#include "grid.h"
+#include "width.h"
+
+#include <unordered_map>
+
+// Splits a line into rows of width w, marking all but the last as wrapped.
+// Wide characters aren't split, unless w is 1.
+static void Rewrap(const std::vector<Cell>& line, int w,
+                   std::vector<std::vector<Cell>>* rows) {
+  size_t begin = 0;
+  do {
+    size_t end = std::min(begin + w, line.size());
+    if (end < line.size() && line[end - 1].flags & Cell::kWide &&
+        end - 1 > begin) {
+      --end;
+    }
+    rows->emplace_back(line.begin() + begin, line.begin() + end);
+    if (end < line.size()) rows->back().back().flags |= Cell::kWrapped;
+    begin = end;
+  } while (begin < line.size());
+}
+
+void Grid::Resize(int w, int h) {
+  CHECK(w > 0 && h > 0);
+  if (w == w_ && h == h_) return;
+  // Rewrap the lines on the screen, starting with the part of the first line
+  // that scrolled off, if any. Blank rows below the cursor and the last
+  // row with text are padding, and not part of any line, even if wrapped.
+  std::vector<Cell> line;
+  if (scrollback_.partial()) scrollback_.PopBack(&line);
+  int last = y_;
+  for (int y = y_ + 1; y < h_; ++y) {
+    for (Cell cell : Row(y)) {
+      cell.flags &= ~Cell::kWrapped;
+      if (cell != Cell()) {
+        last = y;
+        break;
+      }
+    }
+  }
+  int padding = h_ - 1 - last;
+  std::vector<std::vector<Cell>> rows;
+  int cursor = -1;  // Offset of the cursor in line.
+  int x = 0, y = 0;
+  for (int i = 0; i <= last; ++i) {
+    const auto& row = Row(i);
+    if (i == y_) cursor = line.size() + x_;
+    line.insert(line.end(), row.begin(), row.end());
+    if (!line.empty() && line.back().flags & Cell::kWrapped) {
+      line.back().flags &= ~Cell::kWrapped;
+      if (i < last) continue;
+    }
+    // Blanks at the end of a line are dropped, but a cursor past the end of
+    // its line is kept in it with blanks, so that it moves with the line,
+    // and comes back to where it was.
+    while (!line.empty() && line.back() == Cell()) line.pop_back();
+    if (cursor > int(line.size())) line.resize(cursor);
+    size_t first = rows.size();
+    Rewrap(line, w, &rows);
+    if (cursor >= 0) {
+      // Rows may be short of w, before a wide character. Just after the
+      // last cell is column w, as after writing to the last column.
+      size_t row = first;
+      int col = cursor;
+      while (row + 1 < rows.size() && col >= rows[row].size()) {
+        col -= rows[row++].size();
+      }
+      y = row;
+      x = col;
+      cursor = -1;
+    }
+    line.clear();
+  }
+
+  // Fit the rows to the new height: drop padding, then move rows to the
+  // scrollback or back from it, and then pad the top with empty rows.
+  int excess = rows.size() + padding - h;
+  if (excess > 0) {
+    int dropped = std::min(excess, padding);
+    padding -= dropped;
+    excess -= dropped;
+  }
+  if (excess > 0) {
+    for (int i = 0; i < excess; ++i) scrollback_.Push(rows[i]);
+    rows.erase(rows.begin(), rows.begin() + excess);
+    // The cursor stays on its row, unless the rows below it didn't fit and
+    // pushed it to the scrollback. Then it starts over at the top.
+    if (y < excess) x = 0;
+    y = std::max(y - excess, 0);
+  }
+  std::vector<std::vector<Cell>> more;
+  while (rows.size() + padding < h && scrollback_.PopBack(&line)) {
+    more.clear();
+    Rewrap(line, w, &more);
+    int extra = int(more.size()) - int(h - padding - rows.size());
+    for (int i = 0; i < extra; ++i) scrollback_.Push(more[i]);
+    int added = more.size() - std::max(extra, 0);
+    rows.insert(rows.begin(), std::make_move_iterator(more.end() - added),
+                std::make_move_iterator(more.end()));
+    y += added;
+  }
+  if (rows.size() + padding < h) {
+    int added = h - padding - rows.size();
+    rows.insert(rows.begin(), added, std::vector<Cell>());
+    y += added;
+  }
+  rows.resize(h);
+
+  // Rows of the same width are reused, otherwise the old pool is freed.
+  if (w == pool_.width()) {
+    for (auto& row : cells_) pool_.Free(&row);
+  } else {
+    pool_ = RowPool(w);
+  }
+  cells_.resize(h);
+  for (int i = 0; i < h; ++i) {
+    cells_[i] = pool_.Allocate();
+    cells_[i].assign(rows[i].data(), rows[i].data() + rows[i].size());
+  }
+  top_ = 0;
+  w_ = w;
+  h_ = h;
+  scroll_top_ = 0;
+  scroll_bottom_ = h;
+  x_ = x;
+  y_ = y;
+  join_ = false;
+  FixWidth();
+  TouchAll();
+}
+
+void Grid::Put(const u32* runes, int count, u32 style) {
+  for (int i = 0; i < count; ++i) {
+    u32 rune = runes[i];
+    int width = RuneWidth(rune);
+    if (width == 0 || join_) {
+      bool combined = Combine(rune);
+      join_ = combined && rune == 0x200d;
+      // Marks with nothing to join are dropped, but other runes are put.
+      if (combined || width == 0) continue;
+    }
+    width = std::min(width, w_);
+    if (x_ + width > w_) Wrap();
+    auto& row = Row(y_);
+    SplitWide(row, y_, x_, x_ + width);
+    if (row.size() < x_) row.resize(x_);
+    Cell cell(rune, style);
+    if (width == 2) {
+      cell.flags = Cell::kWide;
+      row[x_ + 1] = Cell::Spacer(style);
+    }
+    row[x_] = cell;
+    if (row.size() < x_ + width) row.set_size(x_ + width);
+    Touch(y_, x_, x_ + width);
+    x_ += width;
+  }
+}
+
+bool Grid::Combine(u32 rune) {
+  auto& row = Row(y_);
+  int x = x_ - 1;
+  if (x >= 0 && x < row.size() && row[x].flags & Cell::kSpacer) --x;
+  // Nothing to combine with, e.g. at the start of a row.
+  if (x < 0 || x >= row.size()) return false;
+  Cell& cell = row[x];
+  std::u32string runes;
+  if (cell.flags & Cell::kCluster) {
+    runes = clusters_[cell.rune];
+  } else {
+    runes.push_back(cell.rune);
+  }
+  runes.push_back(rune);
+  u32 id = clusters_.Intern(runes);
+  // Once the table is full, new clusters lose their marks.
+  if (id == ClusterTable::kFull) return false;
+  cell.rune = id;
+  cell.flags |= Cell::kCluster;
+  Touch(y_, x, x + (cell.flags & Cell::kWide ? 2 : 1));
+  return true;
+}
+
+void Grid::ScrollRows(int top, int bottom, int n, bool save) {
+  int height = bottom - top;
+  if (n > 0) {
+    n = std::min(n, height);
+    for (int y = top; y < top + n; ++y) {
+      if (save) scrollback_.Push(Row(y).begin(), Row(y).size());
+      Row(y).clear();
+    }
+    // The cleared rows end up at the bottom, in some order.
+    for (int y = top; y + n < bottom; ++y) std::swap(Row(y), Row(y + n));
+  } else if (n < 0) {
+    n = std::min(-n, height);
+    for (int y = bottom - n; y < bottom; ++y) Row(y).clear();
+    for (int y = bottom - 1; y - n >= top; --y) std::swap(Row(y), Row(y - n));
+  }
+  for (int y = top; y < bottom; ++y) Touch(y, 0, w_ + 1);
+}
+
+void Grid::ScrollbackRows(size_t index, std::vector<std::vector<Cell>>* rows) {
+  std::vector<Cell> line;
+  scrollback_.Line(index, &line);
+  rows->clear();
+  Rewrap(line, w_, rows);
+}
+
+void Grid::TakeDamage(Damage* damage) {
+  // The cursor is drawn over a cell, so if it moved, both cells change.
+  if (x_ != cursor_x_ || y_ != cursor_y_ || scrolled_) {
+    int old_y = cursor_y_ - scrolled_;
+    if (old_y >= 0 && old_y < h_) Touch(old_y, cursor_x_, cursor_x_ + 1);
+    Touch(y_, x_, x_ + 1);
+    cursor_x_ = x_;
+    cursor_y_ = y_;
+  }
+
+  damage->scrolled = scrolled_;
+  damage->rows.clear();
+  for (int word = 0; word < dirty_.size(); ++word) {
+    for (u64 bits = dirty_[word]; bits; bits &= bits - 1) {
+      int i = word * 64 + __builtin_ctzll(bits);
+      if (i >= h_) break;
+      int y = i >= top_ ? i - top_ : i - top_ + h_;
+      damage->rows.push_back({y, damage_[i].begin, damage_[i].end});
+    }
+    dirty_[word] = 0;
+  }
+  scrolled_ = 0;
+}
+
+void Grid::TakeFrame(Frame* frame) {
+  TakeDamage(&frame_damage_);
+  frame->w = w_;
+  frame->h = h_;
+  frame->cursor_x = x_;
+  frame->cursor_y = y_;
+  frame->scrolled = frame_damage_.scrolled;
+  frame->rows.clear();
+  frame->cells.clear();
+  frame->styles.clear();
+  frame->clusters.clear();
+  frame->scrollback_lines = scrollback_.size();
+  frame->scrollback_bytes = scrollback_.MemoryUsage();
+  if (frame_damage_.scrolled >= h_) {
+    // Every row, in order.
+    frame_damage_.rows.clear();
+    for (int y = 0; y < h_; ++y) frame_damage_.rows.push_back({y, 0, w_ + 1});
+  }
+
+  // Styles and clusters are numbered in the order the frame uses them.
+  // frame_styles_[id] is the frame's style id plus 1, or 0 if unused.
+  frame_styles_.resize(styles_.capacity());
+  std::vector<u32> used_styles;
+  std::unordered_map<u32, u32> clusters;
+  for (const auto& damaged : frame_damage_.rows) {
+    const auto& row = Row(damaged.y);
+    int end = std::min(damaged.end, w_ + 1);
+    frame->rows.push_back({damaged.y, damaged.begin, end, frame->cells.size()});
+    for (int x = damaged.begin; x < end; ++x) {
+      Cell cell = x < row.size() ? row[x] : Cell();
+      u32& style = frame_styles_[cell.style];
+      if (!style) {
+        used_styles.push_back(cell.style);
+        frame->styles.push_back(styles_[cell.style]);
+        style = frame->styles.size();
+      }
+      cell.style = style - 1;
+      if (cell.flags & Cell::kCluster) {
+        u32 id = cell.rune;
+        auto it = clusters.emplace(id, frame->clusters.size()).first;
+        if (it->second == frame->clusters.size()) {
+          frame->clusters.push_back(clusters_[cell.rune]);
+        }
+        cell.rune = it->second;
+      }
+      frame->cells.push_back(cell);
+    }
+  }
+  for (u32 id : used_styles) frame_styles_[id] = 0;
+}
+
+void Grid::TouchAll() {
+  dirty_.assign((h_ + 63) / 64, ~u64(0));
+  damage_.assign(h_, {0, w_ + 1});
+  scrolled_ = h_;
+}
+
+void Grid::SweepStyles() {
+  std::vector<bool> live(styles_.capacity());
+  for (const auto& row : cells_) {
+    for (const Cell& cell : row) live[cell.style] = true;
+  }
+  scrollback_.MarkStyles(&live);
+  styles_.Sweep(live);
+  // If most styles are still in use, wait longer before trying again.
+  sweep_size_ = std::max(kMinSweepSize, 2 * styles_.size());
+}
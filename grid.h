@@ -0,0 +1,345 @@
+#ifndef GRID_H_
+#define GRID_H_
+
+#include "base.h"
+#include "cell.h"
+#include "frame.h"
+#include "row_pool.h"
+#include "scrollback.h"
+
+#include <algorithm>
+#include <vector>
+
+// What changed in a Grid since the last call to Grid::TakeDamage().
+struct Damage {
+  // The changed columns [begin, end) of a row.
+  struct Row {
+    int y, begin, end;
+  };
+
+  // The screen scrolled up this many lines, and then the rows changed.
+  // If it is at least the height, every row is in rows.
+  int scrolled = 0;
+  std::vector<Row> rows;  // In no particular order.
+
+  bool empty() const { return scrolled == 0 && rows.empty(); }
+};
+
+class Grid {
+ public:
+  Grid(int w, int h, size_t scrollback_lines = 100000)
+      : w_(w), h_(h), cells_(h), scroll_bottom_(h), pool_(w),
+        scrollback_(scrollback_lines) {
+    for (auto& row : cells_) row = pool_.Allocate();
+    Reset();
+  }
+
+  void Reset() {
+    for (auto& row : cells_) row.clear();
+    // The rest of a line that scrolled off is gone.
+    if (scrollback_.partial()) scrollback_.EndLine();
+    top_ = 0;
+    TouchAll();
+    y_ = h_ - 1;
+    x_ = 0;
+    join_ = false;
+    FixWidth();
+  }
+
+  void ClearLine(int y) {
+    Touch(y, 0, Row(y).size());
+    Row(y).clear();
+  }
+
+  void ClearAroundCursor(bool before) {
+    auto& row = Row(y_);
+    if (!before) {
+      SplitWide(row, y_, x_, x_);
+      Touch(y_, x_, row.size());
+      return row.resize(x_);
+    }
+    SplitWide(row, y_, 0, x_ + 1);
+    Touch(y_, 0, std::min<int>(x_ + 1, row.size()));
+    for (int i = 0; i <= x_ && i < row.size(); ++i) row[i] = Cell();
+  }
+
+  // Rewraps the lines on the screen to the new width. Rows that no longer
+  // fit go to the scrollback, and if there is room, rows come back from it.
+  void Resize(int w, int h);
+
+  void ShiftUp() {
+    // The top row is saved and then reused as the new bottom row.
+    scrollback_.Push(Row(0).begin(), Row(0).size());
+    Row(0).clear();
+    top_ = top_ + 1 == h_ ? 0 : top_ + 1;
+    // Damage moves with the rows, except on the new bottom row.
+    if (scrolled_ < h_) ++scrolled_;
+    Touch(h_ - 1, 0, w_ + 1);
+  }
+
+  Cell cell(int x, int y) {
+    const auto& row = Row(y);
+    return x < row.size() ? row[x] : Cell();
+  }
+
+  // Records that everything changed, e.g. when the grid is shown again.
+  void TouchAll();
+
+  // Moves what changed since the last call into *damage. This includes the
+  // cells under the old and new cursor positions.
+  void TakeDamage(Damage* damage);
+
+  // The id of a style, for use in cells of this grid and its scrollback.
+  // Ids of styles that no cell uses may be reassigned by later calls.
+  u32 Intern(const Style& style) {
+    if (UNLIKELY(styles_.size() >= sweep_size_)) SweepStyles();
+    return styles_.Intern(style);
+  }
+  const Style& style(u32 id) const { return styles_[id]; }
+  // The runes of a cell marked Cell::kCluster.
+  const std::u32string& cluster(u32 id) const { return clusters_[id]; }
+
+  const Scrollback& scrollback() const { return scrollback_; }
+  // A line of the scrollback, wrapped to the grid's width.
+  void ScrollbackRows(size_t index, std::vector<std::vector<Cell>>* rows);
+  void ClearScrollback() { scrollback_.Clear(); }
+  bool SpillScrollback(const char* dir) { return scrollback_.SpillTo(dir); }
+
+  // Like TakeDamage(), but copies the changed cells into *frame, to be
+  // drawn without the grid.
+  void TakeFrame(Frame* frame);
+
+  void Put(Cell value) {
+    join_ = false;
+    if (x_ == w_) Wrap();
+    auto& row = Row(y_);
+    SplitWide(row, y_, x_, x_ + 1);
+    if (row.size() <= x_) row.resize(x_ + 1);
+    Touch(y_, x_, x_ + 1);
+    row[x_++] = value;
+  }
+
+  // Puts a run of single-width characters that share a style.
+  void Put(string_view text, u32 style) {
+    join_ = false;
+    while (!text.empty()) {
+      if (x_ == w_) Wrap();
+      auto& row = Row(y_);
+      int count = std::min<int>(text.size(), w_ - x_);
+      SplitWide(row, y_, x_, x_ + count);
+      if (row.size() < x_) row.resize(x_);
+      Touch(y_, x_, x_ + count);
+      for (int i = 0; i < count; ++i) {
+        row[x_ + i] = Cell(static_cast<u8>(text[i]), style);
+      }
+      if (row.size() < x_ + count) row.set_size(x_ + count);
+      x_ += count;
+      text.remove_prefix(count);
+    }
+  }
+
+  // Puts runes of any width that share a style. Wide runes take two cells,
+  // and zero-width runes join the character before the cursor.
+  void Put(const u32* runes, int count, u32 style);
+
+  void PutBackwards(Cell value) {
+    join_ = false;
+    // Like xterm, this moves one column even over a wide character.
+    if (x_ == 0) {
+      if (y_ == 0) return;
+      y_--;
+      x_ = w_ - 1;
+      FixWidth();
+    } else {
+      x_--;
+    }
+  }
+
+  void CarriageReturn() {
+    x_ = 0;
+    join_ = false;
+  }
+
+  // Moves down a row, scrolling if the cursor is at the bottom margin.
+  void LineFeed() {
+    join_ = false;
+    if (y_ + 1 == scroll_bottom_) {
+      Scroll(1);
+    } else if (y_ + 1 < h_) {
+      ++y_;
+    }
+    FixWidth();
+  }
+
+  // Moves up a row, scrolling if the cursor is at the top margin.
+  void ReverseLineFeed() {
+    join_ = false;
+    if (y_ == scroll_top_) {
+      Scroll(-1);
+    } else if (y_ > 0) {
+      --y_;
+    }
+    FixWidth();
+  }
+
+  // Sets the scroll region to rows [top, bottom), and moves home. Regions
+  // of less than two rows are ignored.
+  void SetScrollRegion(int top, int bottom) {
+    top = std::max(top, 0);
+    bottom = std::min(bottom, h_);
+    if (bottom - top < 2) return;
+    scroll_top_ = top;
+    scroll_bottom_ = bottom;
+    Move(0, 0);
+  }
+
+  // Scrolls the scroll region up by n rows, or down if n < 0. Rows that
+  // scroll off the top of the screen go to the scrollback.
+  void Scroll(int n) {
+    if (n > 0 && scroll_top_ == 0 && scroll_bottom_ == h_) {
+      for (n = std::min(n, h_); n; --n) ShiftUp();
+    } else {
+      ScrollRows(scroll_top_, scroll_bottom_, n, /*save=*/scroll_top_ == 0);
+    }
+  }
+
+  // Inserts or deletes n rows at the cursor, moving the rows below it
+  // within the scroll region.
+  void InsertLines(int n) {
+    if (y_ < scroll_top_ || y_ >= scroll_bottom_) return;
+    ScrollRows(y_, scroll_bottom_, -n, /*save=*/false);
+    x_ = 0;
+    join_ = false;
+  }
+  void DeleteLines(int n) {
+    if (y_ < scroll_top_ || y_ >= scroll_bottom_) return;
+    ScrollRows(y_, scroll_bottom_, n, /*save=*/false);
+    x_ = 0;
+    join_ = false;
+  }
+
+  void Tab(const Cell& fill) {
+    // TODO: mark filled cells as tab/dummies so copy works?
+    // Stops at the last column, so narrow grids without a stop are filled.
+    do Put(fill); while(!IsTab(x_) && x_ < w_);
+  }
+
+  int x() const { return x_; }
+  int y() const { return y_; }
+  int w() const { return w_; }
+  int h() const { return h_; }
+  void Move(int x, int y) {
+    y_ = y;
+    x_ = x;
+    join_ = false;
+    FixWidth();
+  }
+
+  // Ends the character before the cursor, so that a joiner that was last
+  // doesn't join the next rune to it. Moving the cursor does this too.
+  void EndCluster() { join_ = false; }
+
+ private:
+  // Moves to the next row after writing to the last column, or before
+  // writing a wide character that doesn't fit. That leaves the last column
+  // empty.
+  void Wrap() {
+    auto& row = Row(y_);
+    if (x_ < row.size()) {
+      SplitWide(row, y_, x_, x_);
+      Touch(y_, x_, row.size());
+      row.resize(x_);
+    }
+    // Unless the row was cleared under the cursor.
+    if (x_ > 0 && row.size() == x_) row.back().flags |= Cell::kWrapped;
+    CarriageReturn();
+    LineFeed();
+  }
+
+  // Before columns [begin, end) of row y are overwritten, blanks the other
+  // halves of wide characters that they cut in two.
+  void SplitWide(CellRow& row, int y, int begin, int end) {
+    if (UNLIKELY(begin > 0 && begin < row.size() &&
+                 row[begin].flags & Cell::kSpacer)) {
+      row[begin - 1] = Cell();
+      Touch(y, begin - 1, begin);
+    }
+    if (UNLIKELY(end < row.size() && row[end].flags & Cell::kSpacer)) {
+      Cell blank;
+      blank.flags = row[end].flags & Cell::kWrapped;
+      row[end] = blank;
+      Touch(y, end, end + 1);
+    }
+  }
+  // Adds a rune to the character before the cursor. Returns false if there
+  // is none, or the cluster table is full.
+  bool Combine(u32 rune);
+
+  void FixWidth() {
+    auto& row = Row(y_);
+    if (row.size() < x_) row.resize(std::min(x_ + 1, w_));
+  }
+
+  bool IsTab(int x) {
+    // TODO: customizable tab table.
+    return x % 8 == 0;
+  }
+
+  // Screen row y is cells_[(top_ + y) % h_], so scrolling is O(1).
+  int RowIndex(int y) const {
+    int i = top_ + y;
+    return i < h_ ? i : i - h_;
+  }
+  CellRow& Row(int y) { return cells_[RowIndex(y)]; }
+
+  // Records that columns [begin, end) of screen row y changed.
+  void Touch(int y, int begin, int end) {
+    if (begin >= end) return;
+    int i = RowIndex(y);
+    Span& span = damage_[i];
+    if (!(dirty_[i / 64] & u64(1) << i % 64)) {
+      dirty_[i / 64] |= u64(1) << i % 64;
+      span = {begin, end};
+    } else {
+      span.begin = std::min(span.begin, begin);
+      span.end = std::max(span.end, end);
+    }
+  }
+  // Scrolls rows [top, bottom) up by n, or down if n < 0, by swapping the
+  // rows rather than copying cells. If save, rows that scroll off go to the
+  // scrollback.
+  void ScrollRows(int top, int bottom, int n, bool save);
+
+
+  // Frees the ids of styles that no cell uses.
+  void SweepStyles();
+  // Styles are swept when this many are interned.
+  constexpr static size_t kMinSweepSize = 1 << 12;
+  size_t sweep_size_ = kMinSweepSize;
+
+  // Rows have room for w_ cells, from pool_.
+  std::vector<CellRow> cells_;
+  int top_ = 0;
+  int w_ = 0, h_ = 0;
+  int x_ = 0, y_ = -1; // x_ may equal w_;
+  int scroll_top_ = 0, scroll_bottom_ = 0;  // The scroll region.
+
+  // Damage is kept by index in cells_, so it moves with the rows.
+  struct Span {
+    int begin, end;
+  };
+  std::vector<u64> dirty_;  // A bit for each row that has a span.
+  std::vector<Span> damage_;
+  int scrolled_ = 0;
+  int cursor_x_ = 0, cursor_y_ = 0;  // As of the last TakeDamage().
+  // Reused by TakeFrame().
+  Damage frame_damage_;
+  std::vector<u32> frame_styles_;
+  RowPool pool_;
+  StyleTable styles_;
+  ClusterTable clusters_;
+  bool join_ = false;  // The last rune was a zero width joiner.
+  Scrollback scrollback_;
+};
+
+#endif // GRID_H_
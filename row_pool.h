@@ -0,0 +1,90 @@
+#ifndef ROW_POOL_H_
+#define ROW_POOL_H_
+
+#include "base.h"
+#include "cell.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// A row of cells, with room for as many cells as its RowPool's width.
+// Rows are handles: copying one doesn't copy its cells.
+class CellRow {
+ public:
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Cell& operator[](int i) { return cells_[i]; }
+  const Cell& operator[](int i) const { return cells_[i]; }
+  Cell& back() { return cells_[size_ - 1]; }
+  const Cell& back() const { return cells_[size_ - 1]; }
+  Cell* begin() { return cells_; }
+  Cell* end() { return cells_ + size_; }
+  const Cell* begin() const { return cells_; }
+  const Cell* end() const { return cells_ + size_; }
+
+  void clear() { size_ = 0; }
+  // Callers keep size within the pool's width. Only the last cell of a row
+  // may be marked Cell::kWrapped, so a row that grows is no longer wrapped.
+  void resize(int size) {
+    if (size > size_) Unwrap();
+    for (int i = size_; i < size; ++i) cells_[i] = Cell();
+    size_ = size;
+  }
+  // Like resize(), but for cells the caller has already set.
+  void set_size(int size) {
+    if (size > size_) Unwrap();
+    size_ = size;
+  }
+  void assign(const Cell* begin, const Cell* end) {
+    std::copy(begin, end, cells_);
+    size_ = end - begin;
+  }
+
+ private:
+  friend class RowPool;
+  void Unwrap() {
+    if (size_) cells_[size_ - 1].flags &= ~Cell::kWrapped;
+  }
+
+  Cell* cells_ = nullptr;
+  int size_ = 0;
+};
+
+// Allocates rows of a fixed width from slabs of kSlabRows rows, and keeps
+// freed rows for reuse. The slabs are freed with the pool.
+class RowPool {
+ public:
+  constexpr static int kSlabRows = 64;
+
+  explicit RowPool(int width) : width_(width) {}
+
+  int width() const { return width_; }
+
+  CellRow Allocate() {
+    if (free_.empty()) Grow();
+    CellRow row;
+    row.cells_ = free_.back();
+    free_.pop_back();
+    return row;
+  }
+
+  void Free(CellRow* row) {
+    free_.push_back(row->cells_);
+    *row = CellRow();
+  }
+
+ private:
+  void Grow() {
+    slabs_.emplace_back(new Cell[kSlabRows * width_]);
+    Cell* slab = slabs_.back().get();
+    // Rows are allocated from the back, so in address order.
+    for (int i = kSlabRows - 1; i >= 0; --i) free_.push_back(slab + i * width_);
+  }
+
+  int width_;
+  std::vector<std::unique_ptr<Cell[]>> slabs_;
+  std::vector<Cell*> free_;
+};
+
+#endif // ROW_POOL_H_
@@ -0,0 +1,54 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+const u8* FindNonPrintableScalar(const u8* begin, const u8* end) {
+  while (begin != end && *begin >= 0x20 && *begin < 0x7f) ++begin;
+  return begin;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Bytes are compared as signed, so those >= 0x80 are negative and
+// "less than 0x20" catches them along with the C0 controls.
+
+__attribute__((target("sse2")))
+const u8* FindNonPrintableSSE2(const u8* begin, const u8* end) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; end - begin >= 16; begin += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    __m128i special =
+        _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+    if (int mask = _mm_movemask_epi8(special))
+      return begin + __builtin_ctz(mask);
+  }
+  return FindNonPrintableScalar(begin, end);
+}
+
+__attribute__((target("avx2")))
+const u8* FindNonPrintableAVX2(const u8* begin, const u8* end) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  for (; end - begin >= 32; begin += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    __m256i special =
+        _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+    if (u32 mask = _mm256_movemask_epi8(special))
+      return begin + __builtin_ctz(mask);
+  }
+  return FindNonPrintableSSE2(begin, end);
+}
+#endif
+
+static ScanKernel ChooseKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FindNonPrintableAVX2;
+  if (__builtin_cpu_supports("sse2")) return FindNonPrintableSSE2;
+#endif
+  return FindNonPrintableScalar;
+}
+
+const ScanKernel kFindNonPrintable = ChooseKernel();
@@ -0,0 +1,23 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include "base.h"
+
+// Kernels that find the first byte in [begin, end) that is not printable
+// ASCII: < 0x20, 0x7f, or >= 0x80. They return end if there is none.
+using ScanKernel = const u8* (*)(const u8* begin, const u8* end);
+
+const u8* FindNonPrintableScalar(const u8* begin, const u8* end);
+#if defined(__x86_64__) || defined(__i386__)
+const u8* FindNonPrintableSSE2(const u8* begin, const u8* end);
+const u8* FindNonPrintableAVX2(const u8* begin, const u8* end);
+#endif
+
+// The best kernel supported by this CPU, chosen at startup.
+extern const ScanKernel kFindNonPrintable;
+
+inline const u8* FindNonPrintable(const u8* begin, const u8* end) {
+  return kFindNonPrintable(begin, end);
+}
+
+#endif // SCAN_H_
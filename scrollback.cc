@@ -0,0 +1,244 @@
+#include "scrollback.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void PutVarint(u32 value, std::vector<u8>* out) {
+  while (value >= 0x80) {
+    out->push_back(value | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+static u32 GetVarint(const u8** data) {
+  u32 value = 0;
+  for (int shift = 0;; shift += 7) {
+    u8 byte = *(*data)++;
+    value |= u32(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+}
+
+Scrollback::~Scrollback() {
+  if (spill_fd_ >= 0) close(spill_fd_);
+}
+
+bool Scrollback::SpillTo(const char* dir) {
+  std::string path = std::string(dir) + "/scrollback.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+    fprintf(stderr, "creating %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  // Nobody else needs the file, and it goes away when we do.
+  PCHECK(unlink(path.c_str()) == 0);
+  if (spill_fd_ >= 0) close(spill_fd_);
+  spill_fd_ = fd;
+  max_lines_ = SIZE_MAX;
+  return true;
+}
+
+void Scrollback::Push(const Cell* cells, int count) {
+  if (max_lines_ == 0) return;
+  hot_cells_.insert(hot_cells_.end(), cells, cells + count);
+  if (count && cells[count - 1].flags & Cell::kWrapped) {
+    hot_cells_.back().flags &= ~Cell::kWrapped;
+    if (hot_cells_.size() - HotEnd() < kMaxLineCells) return;
+  }
+  EndLine();
+}
+
+void Scrollback::EndLine() {
+  hot_ends_.push_back(hot_cells_.size());
+  if (hot_ends_.size() == kBlockLines) Compress();
+}
+
+bool Scrollback::PopBack(std::vector<Cell>* out) {
+  if (hot_cells_.empty() && hot_ends_.empty()) {
+    if (blocks_.empty()) return false;
+    // Move the newest block back to the hot lines.
+    const ColdBlock& block = blocks_.back();
+    if (cached_ != &block) Decompress(block);
+    hot_cells_.swap(cached_cells_);
+    hot_ends_.swap(cached_ends_);
+    cached_ = nullptr;
+    if (block.data.empty()) spill_size_ = block.file_offset;
+    blocks_.pop_back();
+  }
+  if (!partial()) hot_ends_.pop_back();
+  u32 begin = HotEnd();
+  out->assign(hot_cells_.begin() + begin, hot_cells_.end());
+  hot_cells_.resize(begin);
+  return true;
+}
+
+void Scrollback::Compress() {
+  blocks_.emplace_back();
+  ColdBlock& block = blocks_.back();
+  std::vector<u8>& data = block.data;
+  // The spacer after each wide character is left out, so that wide text
+  // still makes long runs. A wide character at the end of a line has none.
+  std::vector<Cell> cells;
+  cells.reserve(hot_cells_.size());
+  u32 start = 0;
+  for (u32 end : hot_ends_) {
+    PutVarint(end - start, &data);
+    for (u32 i = start; i < end; ++i) {
+      cells.push_back(hot_cells_[i]);
+      if (hot_cells_[i].flags & Cell::kWide && i + 1 < end) {
+        if (hot_cells_[i + 1] == Cell::Spacer(hot_cells_[i].style)) {
+          ++i;
+        } else {
+          cells.back().flags &= ~Cell::kWide;  // Not really wide.
+        }
+      }
+    }
+    start = end;
+  }
+  block.rune_offset = data.size();
+  for (const Cell& cell : cells) PutVarint(cell.rune, &data);
+  block.style_offset = data.size();
+  // Runs of (flags, style), which may span lines.
+  for (size_t i = 0; i < cells.size();) {
+    const Cell& cell = cells[i];
+    size_t run = 1;
+    while (i + run < cells.size() && cells[i + run].flags == cell.flags &&
+           cells[i + run].style == cell.style) {
+      ++run;
+    }
+    PutVarint(run, &data);
+    PutVarint(cell.flags, &data);
+    PutVarint(cell.style, &data);
+    block.styles.push_back(cell.style);
+    i += run;
+  }
+  block.size = data.size();
+  if (spill_fd_ >= 0) {
+    if (pwrite(spill_fd_, data.data(), data.size(), spill_size_) ==
+        ssize_t(data.size())) {
+      block.file_offset = spill_size_;
+      spill_size_ += data.size();
+      std::vector<u8>().swap(data);
+    } else {
+      // Keep this block in memory, e.g. until the disk has space again.
+      fprintf(stderr, "spilling scrollback: %s\n", strerror(errno));
+    }
+  }
+  data.shrink_to_fit();
+  std::sort(block.styles.begin(), block.styles.end());
+  block.styles.erase(std::unique(block.styles.begin(), block.styles.end()),
+                     block.styles.end());
+  block.styles.shrink_to_fit();
+  hot_cells_.clear();
+  hot_ends_.clear();
+
+  if (size() > max_lines_) {
+    if (cached_ == &blocks_.front()) cached_ = nullptr;
+    blocks_.pop_front();
+  }
+}
+
+void Scrollback::Decompress(const ColdBlock& block) const {
+  if (!block.data.empty() || block.size == 0) {
+    return Decompress(block, block.data.data());
+  }
+  // Map the pages holding the block.
+  static const u64 kPageSize = sysconf(_SC_PAGESIZE);
+  u64 start = block.file_offset & ~(kPageSize - 1);
+  size_t length = block.file_offset + block.size - start;
+  void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, spill_fd_, start);
+  PCHECK(map != MAP_FAILED);
+  Decompress(block,
+             static_cast<const u8*>(map) + (block.file_offset - start));
+  PCHECK(munmap(map, length) == 0);
+}
+
+void Scrollback::Decompress(const ColdBlock& block, const u8* data) const {
+  cached_ = &block;
+  cached_ends_.clear();
+  const u8* lengths = data;
+  const u8* runes = lengths + block.rune_offset;
+  const u8* styles = data + block.style_offset;
+  u32 end = 0;
+  while (lengths != runes) {
+    end += GetVarint(&lengths);
+    cached_ends_.push_back(end);
+  }
+  std::vector<Cell> cells;
+  while (runes != styles) cells.emplace_back(GetVarint(&runes), 0);
+  for (u32 i = 0; i < cells.size();) {
+    u32 run = GetVarint(&styles);
+    u32 flags = GetVarint(&styles);
+    u32 style = GetVarint(&styles);
+    for (; run; --run, ++i) {
+      cells[i].flags = flags;
+      cells[i].style = style;
+    }
+  }
+  // Put back the spacers.
+  cached_cells_.clear();
+  cached_cells_.reserve(end);
+  const Cell* cell = cells.data();
+  for (u32 line_end : cached_ends_) {
+    while (cached_cells_.size() < line_end) {
+      cached_cells_.push_back(*cell);
+      if (cell->flags & Cell::kWide && cached_cells_.size() < line_end) {
+        cached_cells_.push_back(Cell::Spacer(cell->style));
+      }
+      ++cell;
+    }
+  }
+}
+
+void Scrollback::Line(size_t index, std::vector<Cell>* out) const {
+  CHECK(index < size());
+  const std::vector<Cell>* cells = &hot_cells_;
+  const std::vector<u32>* ends = &hot_ends_;
+  size_t block = index / kBlockLines;
+  if (block < blocks_.size()) {
+    if (cached_ != &blocks_[block]) Decompress(blocks_[block]);
+    cells = &cached_cells_;
+    ends = &cached_ends_;
+  }
+  index -= std::min(block, blocks_.size()) * kBlockLines;
+  u32 begin = index ? (*ends)[index - 1] : 0;
+  u32 end = index < ends->size() ? (*ends)[index] : cells->size();
+  out->assign(cells->begin() + begin, cells->begin() + end);
+}
+
+void Scrollback::Clear() {
+  if (spill_fd_ >= 0) {
+    PCHECK(ftruncate(spill_fd_, 0) == 0);
+    spill_size_ = 0;
+  }
+  blocks_.clear();
+  hot_cells_.clear();
+  hot_ends_.clear();
+  cached_ = nullptr;
+}
+
+void Scrollback::MarkStyles(std::vector<bool>* live) const {
+  for (const ColdBlock& block : blocks_) {
+    for (u32 style : block.styles) (*live)[style] = true;
+  }
+  for (const Cell& cell : hot_cells_) (*live)[cell.style] = true;
+}
+
+size_t Scrollback::MemoryUsage() const {
+  size_t bytes = hot_cells_.capacity() * sizeof(Cell) +
+                 hot_ends_.capacity() * sizeof(u32) +
+                 cached_cells_.capacity() * sizeof(Cell) +
+                 cached_ends_.capacity() * sizeof(u32);
+  for (const ColdBlock& block : blocks_) {
+    bytes += sizeof(block) + block.data.capacity() +
+             block.styles.capacity() * sizeof(u32);
+  }
+  return bytes;
+}
@@ -0,0 +1,102 @@
+#ifndef SCROLLBACK_H_
+#define SCROLLBACK_H_
+
+#include "base.h"
+#include "cell.h"
+
+#include <deque>
+#include <vector>
+
+// Lines that have scrolled off the top of a Grid, oldest first.
+//
+// Rows that wrap are joined, so lines are stored whole and don't depend on
+// the grid's width: they are rewrapped when read, and resizing the grid
+// costs nothing here. A line that continues on the screen is partial until
+// its last row is pushed.
+//
+// Recent lines are kept as cells in a flat arena. Every kBlockLines lines
+// they are compressed into a cold block: a varint stream of line lengths and
+// runes, and a run-length stream of flags and styles. Text compresses to
+// about one byte per character, and the spacers after wide characters are
+// left out. Cold blocks are only decompressed to read
+// their lines, e.g. when the user scrolls back.
+//
+// Optionally, cold blocks are appended to a file instead, and mapped back in
+// to be read. Then history is unlimited, and memory use stays flat: the page
+// cache holds as much of the file as it can spare.
+class Scrollback {
+ public:
+  constexpr static int kBlockLines = 1024;
+
+  // Keeps at most max_lines lines, dropping the oldest block at a time.
+  explicit Scrollback(size_t max_lines = 100000) : max_lines_(max_lines) {}
+  ~Scrollback();
+  Scrollback(const Scrollback&) = delete;
+  Scrollback& operator=(const Scrollback&) = delete;
+
+  // Spills cold blocks to an unlinked file in dir, and stops dropping old
+  // lines. Returns false if the file can't be created.
+  bool SpillTo(const char* dir);
+
+  // Adds a row. If its last cell is marked Cell::kWrapped, the line goes on
+  // in the next row.
+  void Push(const Cell* cells, int count);
+  void Push(const std::vector<Cell>& row) { Push(row.data(), row.size()); }
+  // Ends a partial line, e.g. because the rest of it was erased.
+  void EndLine();
+  // Moves the newest line, which may be partial, into *out.
+  bool PopBack(std::vector<Cell>* out);
+
+  // The number of lines stored.
+  size_t size() const {
+    return blocks_.size() * kBlockLines + hot_ends_.size() + partial();
+  }
+  // Whether the newest line is partial.
+  bool partial() const { return hot_cells_.size() > HotEnd(); }
+  // Copies line index, counting from the oldest, into *out.
+  void Line(size_t index, std::vector<Cell>* out) const;
+
+  void Clear();
+
+  // Sets live[id] for each style that a stored cell uses.
+  void MarkStyles(std::vector<bool>* live) const;
+
+  // The bytes of memory allocated for the lines.
+  size_t MemoryUsage() const;
+
+ private:
+  struct ColdBlock {
+    std::vector<u8> data;  // Empty if the block was spilled.
+    u64 file_offset;
+    u32 size;
+    u32 rune_offset;   // After the line lengths.
+    u32 style_offset;  // After the runes.
+    std::vector<u32> styles;  // Sorted ids of the styles used.
+  };
+
+  // Lines longer than this are split, even if they wrapped.
+  constexpr static u32 kMaxLineCells = 1 << 16;
+
+  // Where the last whole hot line ends.
+  u32 HotEnd() const { return hot_ends_.empty() ? 0 : hot_ends_.back(); }
+  void Compress();
+  void Decompress(const ColdBlock& block) const;
+  void Decompress(const ColdBlock& block, const u8* data) const;
+
+  size_t max_lines_;
+  std::deque<ColdBlock> blocks_;
+  // Hot lines: line i is hot_cells_[hot_ends_[i - 1], hot_ends_[i]), and
+  // a partial line takes up the rest.
+  std::vector<Cell> hot_cells_;
+  std::vector<u32> hot_ends_;
+  // The file that blocks are spilled to, or -1.
+  int spill_fd_ = -1;
+  u64 spill_size_ = 0;
+
+  // The last block that was decompressed, in the same form as the hot lines.
+  mutable const ColdBlock* cached_ = nullptr;
+  mutable std::vector<Cell> cached_cells_;
+  mutable std::vector<u32> cached_ends_;
+};
+
+#endif // SCROLLBACK_H_
@@ -1,6 +1,9 @@
 #include "base.h"
 #include "buffers.h"
 #include "escape_parser.h"
+#include "frame.h"
+#include "grid.h"
+#include "uring.h"
 
 #include <cstdio>
 #include <cstring>
@@ -9,10 +12,17 @@
 #include <pty.h>
 #include <unistd.h>
 #include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <memory>
+#include <string>
+#include <thread>
 #include <X11/Xlib.h>
 #include <vector>
 
@@ -28,6 +38,22 @@ static void ExecShell(int slave) {
   execl(shell, shell, nullptr);
 }
 
+// The directory for our cache files, which is created if needed.
+static std::string CacheDir() {
+  std::string dir;
+  if (const char* cache = getenv("XDG_CACHE_HOME")) {
+    dir = cache;
+  } else if (const char* home = getenv("HOME")) {
+    dir = std::string(home) + "/.cache";
+  } else {
+    dir = "/tmp";
+  }
+  mkdir(dir.c_str(), 0700);
+  dir += "/oterm";
+  mkdir(dir.c_str(), 0700);
+  return dir;
+}
+
 static void HandleSIGCHLD(int) {
   int status;
   pid_t pid = waitpid(-1, &status, WNOHANG);
@@ -36,221 +62,316 @@ static void HandleSIGCHLD(int) {
   exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128);
 }
 
-struct Cell {
-  constexpr static u8 kDefaultFg = 7;
-  constexpr static u8 kDefaultBg = 0;
-  enum {
-    kBold = 1 << 0,
-    kItalic = 1 << 1,
-    kUnderline = 1 << 2,
-    kInverse = 1 << 3,
-  };
-
-  u32 rune;
-  u8 fg = kDefaultFg;
-  u8 bg = kDefaultBg;
-  u8 attr = 0;
+struct Keypress {
+  // TODO: modifiers
+  KeySym sym;
+  const char* text;
 };
-class Grid {
+
+// Adds to the count of an eventfd, waking a thread that waits on it.
+static void Signal(int fd) {
+  u64 one = 1;
+  while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+// Resets the count of an eventfd. If the fd is blocking, waits for it to be
+// signalled first.
+static void Wait(int fd) {
+  u64 count;
+  while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+}
+
+// Reads from the PTY on a thread of its own, into a ring that the main
+// thread parses from. So the shell is never blocked on a full PTY while we
+// draw, and reads overlap with parsing.
+//
+// Reads go on until the PTY has nothing more or the ring is full, and each
+// may fill all the contiguous space in the ring. Linux hands out at most
+// 4 KiB of PTY output per read(), so a bigger buffer saves no syscalls.
+//
+// With io_uring, a multishot read stays posted instead, and data arrives
+// in the ring's own buffers: one syscall can wait for many reads.
+class PtyReader {
  public:
-  Grid(int w, int h) : w_(w), h_(h), cells_(h) {
-    Reset();
-  }
+  constexpr static int kRingSize = 1 << 20;
 
-  void Reset() {
-    for (auto& row : cells_) row.clear();
-    y_ = h_ - 1;
-    x_ = 0;
-    FixWidth();
+  struct Stats {
+    size_t bytes = 0;
+    size_t reads = 0;  // Reads that returned data.
+    size_t syscalls = 0;
+  };
+
+  PtyReader(int tty, bool io_uring)
+      : tty_(tty), ready_fd_(eventfd(0, EFD_NONBLOCK)),
+        space_fd_(eventfd(0, 0)) {
+    PCHECK(ready_fd_ >= 0);
+    PCHECK(space_fd_ >= 0);
+#ifdef HAVE_IO_URING
+    if (io_uring) {
+      using_io_uring_ = uring_.Init(4) && uring_.Supports(kOpReadMultishot) &&
+                        uring_.ProvideBuffers(kUringBuffers, 4096);
+      if (!using_io_uring_) {
+        fprintf(stderr, "No io_uring multishot reads, using read()\n");
+      }
+    }
+#endif
+    std::thread([this] { Run(); }).detach();
   }
 
-  void ClearLine(int y) {
-    cells_[y].clear();
+  // Readable when data is added to the empty ring. Call Acknowledge() once
+  // it is, and then read until the ring is empty.
+  int fd() const { return ready_fd_; }
+  void Acknowledge() { Wait(ready_fd_); }
+
+  bool HasBlock() const { return ring_->HasBlock(); }
+  int GetBlock(const u8** data) { return ring_->GetBlock(data); }
+  void Shift(int n) {
+    if (ring_->Shift(n)) Signal(space_fd_);
   }
 
-  void ClearAroundCursor(bool before) {
-    auto& row = cells_[y_];
-    if (!before) return row.resize(x_);
-    for (int i = 0; i <= x_ && i < row.size(); ++i) row[i] = Cell();
+  Stats stats() const {
+    Stats stats;
+    stats.bytes = bytes_.load(std::memory_order_relaxed);
+    stats.reads = reads_.load(std::memory_order_relaxed);
+    stats.syscalls = syscalls_.load(std::memory_order_relaxed);
+    return stats;
   }
 
-  void Resize(int w, int h) {
-    CHECK(w > 0 && h > 0);
-    if (int dh = h - h_) {
-      if (dh > 0) {
-        // Insert rows at the start: insert them at the end and then swap.
-        cells_.resize(h);
-        for (int i = h_ - 1; i >= 0; --i) {
-          swap(cells_[i], cells_[i + dh]);
-        }
+ private:
+  void Run() {
+#ifdef HAVE_IO_URING
+    if (using_io_uring_) return RunUring();
+#endif
+    while (1) {
+      u8* data;
+      int space = ring_->GetSpace(&data);
+      if (space == 0) {
+        // Wait for the main thread to catch up.
+        Wait(space_fd_);
+        continue;
       }
-      if (h < h_ ) {
-        // Delete rows from start: swap first and then delete from end.
-        for (int i = 0; i < h; ++i) {
-          swap(cells_[i], cells_[i - dh]);
+      int count = read(tty_, data, space);
+      syscalls_.fetch_add(1, std::memory_order_relaxed);
+      if (count < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) {
+          pollfd poll_tty = {tty_, POLLIN, 0};
+          poll(&poll_tty, 1, -1);
+          syscalls_.fetch_add(1, std::memory_order_relaxed);
+          continue;
         }
-        cells_.resize(h);
+        fprintf(stderr, "reading from master: %s\n", strerror(errno));
+        return;
       }
-      y_ += dh;
-      h_ = h;
+      if (count == 0) return;
+      reads_.fetch_add(1, std::memory_order_relaxed);
+      Pushed(count);
     }
-    // TODO: rewrapping
-    for (auto& row : cells_) if (row.size() > w) row.resize(w);
-    if (x_ > w) x_ = w;
-    w_ = w;
   }
 
-  void ShiftUp() {
-    // Maybe we should have a different memory representation to make this fast.
-    cells_[0].clear();
-    for (int i = 1; i < h_; ++i) {
-      swap(cells_[i - 1], cells_[i]);
-    }
+  // Counts count bytes that were written at GetSpace(), and hands them to
+  // the main thread.
+  void Pushed(int count) {
+    bytes_.fetch_add(count, std::memory_order_relaxed);
+    if (ring_->Push(count)) Signal(ready_fd_);
   }
 
-  Cell& cell(int x, int y) {
-    return cells_[y][x];
-  }
-
-  void Dump() {
-    for (int y = 0; y < h_; ++y) {
-      for (int x = 0; x <= w_; ++x) {
-        Cell cell = x < cells_[y].size() ? cells_[y][x] : Cell();
-        bool inverse = cell.attr & Cell::kInverse || (x == x_ && y == y_);
-        fprintf(stderr, "%c[38;5;%dm%c[48;5;%dm",
-            0x1b, inverse ? cell.bg : cell.fg,
-            0x1b, inverse ? cell.fg : cell.bg);
-        if (cell.attr & Cell::kBold) fprintf(stderr, "%c[1m", 0x1b);
-        if (cell.attr & Cell::kItalic) fprintf(stderr, "%c[3m", 0x1b);
-        if (cell.attr & Cell::kUnderline) fprintf(stderr, "%c[4m", 0x1b);
-        if (cell.attr & Cell::kItalic) fprintf(stderr, "%c[3m", 0x1b);
-        fputc(isprint(cell.rune) ? cell.rune : ' ', stderr);
-        fprintf(stderr, "%c[0m", 0x1b);
+#ifdef HAVE_IO_URING
+  constexpr static int kUringBuffers = 16;
+
+  void RunUring() {
+    bool posted = false;
+    while (1) {
+      if (!posted) {
+        io_uring_sqe* sqe = uring_.Prepare(kOpReadMultishot, tty_, 0);
+        CHECK(sqe);
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = Uring::kBufferGroup;
+        posted = true;
       }
-      fputc('\n', stderr);
+      int result = uring_.Enter(1, -1);
+      syscalls_.fetch_add(1, std::memory_order_relaxed);
+      if (result < 0 && result != -EINTR) {
+        fprintf(stderr, "waiting for master: %s\n", strerror(-result));
+        return;
+      }
+      bool done = false;
+      uring_.Reap([&](const io_uring_cqe& cqe) {
+        // The read stops when it runs out of buffers, or fails.
+        if (!(cqe.flags & IORING_CQE_F_MORE)) posted = false;
+        if (cqe.res > 0) {
+          reads_.fetch_add(1, std::memory_order_relaxed);
+          int id = Uring::BufferId(cqe);
+          Copy(uring_.buffer(id), cqe.res);
+          uring_.Recycle(id);
+        } else if (cqe.res != -ENOBUFS && cqe.res != -EINTR) {
+          if (cqe.res < 0) {
+            fprintf(stderr, "reading from master: %s\n", strerror(-cqe.res));
+          }
+          done = true;
+        }
+      });
+      if (done) return;
     }
   }
 
-  void Put(Cell value) {
-    // TODO: wide characters
-    if (x_ == w_) {
-      // TODO record soft-wrap
-      CarriageReturn();
-      LineFeed();
-    }
-    auto& row = cells_[y_];
-    if (x_ == row.size()) row.emplace_back();
-    row[x_++] = value;
-  }
-
-  void PutBackwards(Cell value) {
-    // TODO: wide characters
-    if (x_ == 0) {
-      if (y_ == 0) return;
-      y_--;
-      x_ = w_ - 1;
-      FixWidth();
-    } else {
-      x_--;
+  // Copies data into the ring, waiting for space if need be.
+  void Copy(const u8* data, int count) {
+    while (count) {
+      u8* space;
+      int size = std::min(ring_->GetSpace(&space), count);
+      if (size == 0) {
+        Wait(space_fd_);
+        continue;
+      }
+      memcpy(space, data, size);
+      Pushed(size);
+      data += size;
+      count -= size;
     }
   }
 
-  void CarriageReturn() {
-    x_ = 0;
-  }
+  Uring uring_;
+  bool using_io_uring_ = false;
+#endif
+
+  int tty_;
+  int ready_fd_;  // Counts pushes to the empty ring.
+  int space_fd_;  // Counts shifts from the full ring.
+  std::atomic<size_t> bytes_{0};
+  std::atomic<size_t> reads_{0};
+  std::atomic<size_t> syscalls_{0};
+  std::unique_ptr<ByteRing<kRingSize>> ring_ =
+      std::make_unique<ByteRing<kRingSize>>();
+};
+
+// Draws frames on a thread of its own, so that a slow frame never holds up
+// parsing or input. Frames are handed over rather than shared: the main
+// thread fills a frame that isn't busy and publishes it, and the render
+// thread marks it not busy once it is drawn. With two frames, one can be
+// filled while the other is drawn.
+class Renderer {
+ public:
+  struct Snapshot {
+    Frame frame;
+    History<192> read_history;
+    History<192> write_history;
+    PtyReader::Stats read_stats;
+  };
 
-  void LineFeed() {
-    if (y_ + 1 == h_) ShiftUp(); else ++y_;
-    FixWidth();
+  Renderer() : wake_fd_(eventfd(0, 0)), drawn_fd_(eventfd(0, EFD_NONBLOCK)) {
+    PCHECK(wake_fd_ >= 0);
+    PCHECK(drawn_fd_ >= 0);
+    std::thread([this] { Run(); }).detach();
   }
 
-  void Tab(const Cell& fill) {
-    // TODO: mark filled cells as tab/dummies so copy works?
-    do Put(fill); while(!IsTab(x_));
+  // Readable after a frame is drawn. Call Acknowledge() once it is.
+  int fd() const { return drawn_fd_; }
+  void Acknowledge() { Wait(drawn_fd_); }
+
+  // A frame to fill, or nullptr until the render thread catches up.
+  Snapshot* Acquire() {
+    if (ready_.load(std::memory_order_acquire)) return nullptr;
+    for (int i = 0; i < kFrames; ++i) {
+      if (!busy_[i].load(std::memory_order_acquire)) return &snapshots_[i];
+    }
+    return nullptr;
   }
+  bool CanAcquire() { return Acquire() != nullptr; }
 
-  int x() const { return x_; }
-  int y() const { return y_; }
-  int w() const { return w_; }
-  int h() const { return h_; }
-  void Move(int x, int y) {
-    y_ = y;
-    x_ = x;
-    FixWidth();
+  // Hands a frame from Acquire() to the render thread.
+  void Publish(Snapshot* snapshot) {
+    busy_[snapshot - snapshots_].store(true, std::memory_order_relaxed);
+    ready_.store(snapshot, std::memory_order_release);
+    Signal(wake_fd_);
   }
 
  private:
-  void FixWidth() {
-    auto& row = cells_[y_];
-    if (row.size() < x_) row.resize(std::min(x_ + 1, w_));
-  }
+  constexpr static int kFrames = 2;
 
-  bool IsTab(int x) {
-    // TODO: customizable tab table.
-    return x % 8 == 0;
+  void Run() {
+    while (1) {
+      Wait(wake_fd_);
+      Snapshot* snapshot = ready_.exchange(nullptr, std::memory_order_acquire);
+      if (!snapshot) continue;
+      Draw(snapshot);
+      busy_[snapshot - snapshots_].store(false, std::memory_order_release);
+      Signal(drawn_fd_);
+    }
   }
 
-  std::vector<std::vector<Cell>> cells_;
-  int w_ = 0, h_ = 0;
-  int x_ = 0, y_ = -1; // x_ may equal w_;
-};
+  static void Draw(Snapshot* snapshot) {
+    const Frame& frame = snapshot->frame;
+    fprintf(stderr, "=====\n");
+    frame.Dump();
+    fprintf(stderr, "-----\nScrollback: %zu lines in %zu KiB\n",
+            frame.scrollback_lines, frame.scrollback_bytes >> 10);
+    const PtyReader::Stats& stats = snapshot->read_stats;
+    fprintf(stderr, "PTY: %zu KiB in %zu reads and %zu syscalls, "
+            "%zu bytes per syscall\n", stats.bytes >> 10, stats.reads,
+            stats.syscalls, stats.syscalls ? stats.bytes / stats.syscalls : 0);
+    fprintf(stderr, "Read:\n");
+    snapshot->read_history.Dump();
+    fprintf(stderr, "Write:\n");
+    snapshot->write_history.Dump();
+    fprintf(stderr, "=====\n");
+  }
 
-struct Keypress {
-  // TODO: modifiers
-  KeySym sym;
-  const char* text;
+  Snapshot snapshots_[kFrames];
+  std::atomic<bool> busy_[kFrames] = {};  // Published, and not yet drawn.
+  std::atomic<Snapshot*> ready_{nullptr};  // Published, and not yet taken.
+  int wake_fd_;   // Counts publishes.
+  int drawn_fd_;  // Counts frames drawn.
 };
 
-class Shell : public DebugActions {
+// Final, so the parser calls the actions below directly.
+class Shell final : public DebugActions {
  public:
-   Shell(int tty) : tty_(tty), parser_(this), grid_(80, 25) {
+   Shell(int tty, PtyReader* reader)
+       : tty_(tty), reader_(reader), parser_(this), primary_(80, 25),
+         alternate_(80, 25, /*scrollback_lines=*/0), grid_(&primary_) {
      int tty_flags = fcntl(tty_, F_GETFL);
      PCHECK(tty_flags >= 0);
      PCHECK(fcntl(tty_, F_SETFL, tty_flags | O_NONBLOCK) >= 0);
    }
 
-   void Read() {
-     int count = read(tty_, &read_buf_[0], read_buf_.size());
-     if (count < 0) {
-       switch (errno) {
-         case EAGAIN: case EINTR:
-           break;
-         default:
-           fprintf(stderr, "reading from master: %s\n", strerror(errno));
-           break;
-       }
-       return;
-     }
-     read_history_.Write(&read_buf_[0], count);
-     for (int i = 0; i < count; ++i) {
-       u8 c = read_buf_[i];
-       // XXX: unicode decode instead
-       if (parser_.Consume(c)) continue;
-       if (isprint(c)) {
-         fputc(c, stderr);
-         grid_.Put(Format(c));
-       } else {
-         fprintf(stderr, "[%02x]", c);
-       }
-     }
+   // Parses a block of what the shell wrote. Returns false if there is
+   // nothing more to read for now.
+   bool Read() {
+     const u8* data;
+     int count = reader_->GetBlock(&data);
+     if (count == 0) return false;
+     read_history_.Write(data, count);
+     parser_.ConsumeSpan(data, count, [this](auto... text) { Print(text...); });
+     reader_->Shift(count);
+     return true;
    }
 
-  void Update() {
-    fprintf(stderr, "=====\n");
-    grid_.Dump();
-    fprintf(stderr, "-----\nRead:\n");
-    read_history_.Dump();
-    fprintf(stderr, "Write:\n");
-    write_history_.Dump();
-    fprintf(stderr, "=====\n");
+  // Sends what changed to the renderer. Returns false if it has no frame
+  // free, and then the changes wait for the next call.
+  bool Update(Renderer* renderer) {
+    Renderer::Snapshot* snapshot = renderer->Acquire();
+    if (!snapshot) return false;
+    grid_->TakeFrame(&snapshot->frame);
+    if (snapshot->frame.empty()) return true;
+    snapshot->read_history = read_history_;
+    snapshot->write_history = write_history_;
+    snapshot->read_stats = reader_->stats();
+    renderer->Publish(snapshot);
+    return true;
   }
 
+   bool SpillScrollback(const char* dir) {
+     return grid_->SpillScrollback(dir);
+   }
+
+   // Input for the PTY is written in batches of up to kMaxWriteBlocks.
+   constexpr static int kMaxWriteBlocks = 16;
    bool NeedsWrite() { return write_queue_.HasBlock(); }
    void Write() {
      CHECK(NeedsWrite());
-     u8* buf;
-     int count = write_queue_.GetBlock(&buf);
-     count = write(tty_, buf, count);
+     iovec blocks[kMaxWriteBlocks];
+     int count = writev(tty_, blocks, GetWriteBlocks(blocks));
      if (count < 0) {
        switch (errno) {
          case EAGAIN: case EINTR:
@@ -261,8 +382,22 @@ class Shell : public DebugActions {
        }
        return;
      }
+     Wrote(count);
+   }
+   // The input to write next, for an event loop that writes it itself.
+   int GetWriteBlocks(iovec blocks[kMaxWriteBlocks]) {
+     return write_queue_.GetBlocks(blocks, kMaxWriteBlocks);
+   }
+   // Drops count bytes from GetWriteBlocks(), once they are written.
+   void Wrote(int count) {
+     iovec blocks[kMaxWriteBlocks];
+     int n = GetWriteBlocks(blocks);
+     for (int i = 0, left = count; i < n && left; ++i) {
+       int size = std::min<int>(left, blocks[i].iov_len);
+       write_history_.Write(static_cast<const u8*>(blocks[i].iov_base), size);
+       left -= size;
+     }
      write_queue_.Shift(count);
-     write_history_.Write(buf, count);
    }
 
    void Write(const u8* data, int len) { write_queue_.Push(data, len); }
@@ -275,158 +410,121 @@ class Shell : public DebugActions {
    }
 
   void Control(u8 command) override {
+    grid_->EndCluster();
     switch(command) {
       case '\r':
-        return grid_.CarriageReturn();
+        return grid_->CarriageReturn();
       case '\n':
-        return grid_.LineFeed();
+        return grid_->LineFeed();
       case '\t':
-        return grid_.Tab(Format(' '));
+        return grid_->Tab(Format(' '));
       case 0x07:
         printf("Bell!\n");
         return;
       case 0x08:
-        grid_.PutBackwards(Format(' '));
+        grid_->PutBackwards(Format(' '));
         return;
     }
     DebugActions::Control(command);
   }
 
-  void Escape(const std::string& command) override {
+  void Escape(string_view command) override {
     if (command.size() == 1) switch (command[0]) {
     case 'c': // reset
-      format_ = Cell();
-      grid_.Reset();
+      UseAlternateScreen(false);
+      format_ = Style();
+      style_ = 0;
+      grid_->Reset();
+      grid_->SetScrollRegion(0, grid_->h());
       return;
+    case '7':
+      return SaveCursor();
+    case '8':
+      return RestoreCursor();
+    case 'D': // index
+      return grid_->LineFeed();
+    case 'E': // next line
+      grid_->CarriageReturn();
+      return grid_->LineFeed();
+    case 'M': // reverse index
+      return grid_->ReverseLineFeed();
     }
     DebugActions::Escape(command);
   }
 
-  void CSI(const std::string& command, const std::vector<int>& args) override {
+  void CSI(string_view command, const EscapeParser::Args& args) override {
     if (LIKELY(command.size() == 1)) switch (command[0]) {
-    case 'H': { // Move
-      int x = Get(args, 0, 1) - 1, y = Get(args, 1, 1) - 1;
-      x = std::max(0, std::min(x, grid_.w() - 1));
-      y = std::max(0, std::min(y, grid_.h() - 1));
-      grid_.Move(x, y);
+    case 'H': case 'f': { // Move
+      int y = Get(args, 0, 1) - 1, x = Get(args, 1, 1) - 1;
+      x = std::max(0, std::min(x, grid_->w() - 1));
+      y = std::max(0, std::min(y, grid_->h() - 1));
+      grid_->Move(x, y);
       return;
     }
     case 'J': switch (Get(args, 0, 0)) {
       case 0: // Clear from cursor.
-        grid_.ClearAroundCursor(/*before=*/false);
-        for (int i = grid_.y() + 1; i < grid_.h(); ++i) grid_.ClearLine(i);
+        grid_->ClearAroundCursor(/*before=*/false);
+        for (int i = grid_->y() + 1; i < grid_->h(); ++i) grid_->ClearLine(i);
         return;
       case 1: // Clear to cursor.
-        grid_.ClearAroundCursor(/*before=*/true);
-        for (int i = 0; i < grid_.y(); ++i) grid_.ClearLine(i);
+        grid_->ClearAroundCursor(/*before=*/true);
+        for (int i = 0; i < grid_->y(); ++i) grid_->ClearLine(i);
         return;
       case 2: { // Clear whole display
-        int x = grid_.x(), y = grid_.y();
-        grid_.Reset();
-        grid_.Move(x, y);
+        int x = grid_->x(), y = grid_->y();
+        grid_->Reset();
+        grid_->Move(x, y);
         return;
       }
+      case 3: // Clear scrollback
+        grid_->ClearScrollback();
+        return;
     }
+    break;
     case 'K': switch (Get(args, 0, 0)) {
       case 0: // Clear from cursor;
-        grid_.ClearAroundCursor(/*before=*/false);
+        grid_->ClearAroundCursor(/*before=*/false);
         return;
       case 1: // Clear from cursor;
-        grid_.ClearAroundCursor(/*before=*/true);
+        grid_->ClearAroundCursor(/*before=*/true);
         return;
       case 2: // Clear from cursor;
-        grid_.ClearAroundCursor(false);
-        grid_.ClearAroundCursor(true);
+        grid_->ClearAroundCursor(false);
+        grid_->ClearAroundCursor(true);
         return;
       }
+      break;
     case 'A':
-      return grid_.Move(grid_.x(), std::max(grid_.y() - 1, grid_.h() - 1));
+      return grid_->Move(grid_->x(), std::max(grid_->y() - Get(args, 0, 1), 0));
     case 'B': case 'e':
-      return grid_.Move(grid_.x(), std::max(grid_.y() + 1, grid_.h() - 1));
+      return grid_->Move(grid_->x(),
+                        std::min(grid_->y() + Get(args, 0, 1), grid_->h() - 1));
     case 'C': case 'n':
-      return grid_.Move(std::min(grid_.x() + Get(args, 0, 1), grid_.w()), grid_.y());
+      return grid_->Move(std::min(grid_->x() + Get(args, 0, 1), grid_->w()), grid_->y());
     case 'D':
-      return grid_.Move(std::max(grid_.x() - Get(args, 0, 1), 0), grid_.y());
+      return grid_->Move(std::max(grid_->x() - Get(args, 0, 1), 0), grid_->y());
     case 'E':
-      return grid_.Move(0, std::min(grid_.y() + Get(args, 0, 1), grid_.h() - 1));
+      return grid_->Move(0, std::min(grid_->y() + Get(args, 0, 1), grid_->h() - 1));
     case 'F':
-      return grid_.Move(0, std::max(grid_.y() - Get(args, 0, 1), 0));
+      return grid_->Move(0, std::max(grid_->y() - Get(args, 0, 1), 0));
+    case 'L': // insert lines
+      return grid_->InsertLines(Get(args, 0, 1));
+    case 'M': // delete lines
+      return grid_->DeleteLines(Get(args, 0, 1));
+    case 'S': // scroll up
+      return grid_->Scroll(Get(args, 0, 1));
+    case 'T': // scroll down
+      return grid_->Scroll(-Get(args, 0, 1));
+    case 'r': // set scroll region
+      return grid_->SetScrollRegion(Get(args, 0, 1) - 1,
+                                   Get(args, 1, grid_->h()));
     case 'm':
-      if (args.size() == 3 && args[0] == 38 && args[1] == 5) {
-        format_.fg = (args[2] < 0 || args[2] >= 256) ? Cell::kDefaultFg : args[2];
-        return;
-      }
-      if (args.size() == 3 && args[0] == 48 && args[1] == 5) {
-        format_.bg = (args[2] < 0 || args[2] >= 256) ? Cell::kDefaultBg : args[2];
-        return;
-      }
-      for (int a : args) {
-        auto& attr = format_.attr;
-        auto& fg = format_.fg;
-        auto& bg = format_.bg;
-        switch (a) {
-        case 0:
-          format_ = Cell();
-          continue;
-        case 1:
-          attr |= Cell::kBold;
-          continue;
-        case 2: // faint
-          attr &= ~Cell::kBold;
-          continue;
-        case 3:
-          attr |= Cell::kItalic;
-          continue;
-        case 4:
-          attr |= Cell::kUnderline;
-          continue;
-        case 7:
-          attr |= Cell::kInverse;
-          continue;
-        case 21: // double-underline
-          attr |= Cell::kUnderline;
-          continue;
-        case 22:
-          attr &= ~Cell::kBold;
-          continue;
-        case 23:
-          attr &= ~Cell::kItalic;
-          continue;
-        case 24:
-          attr &= ~Cell::kUnderline;
-          continue;
-        case 27:
-          attr &= ~Cell::kInverse;
-          continue;
-        case 5: // blink
-        case 8: // hidden
-        case 9: // strikethrough
-        case 25: // no blink
-        case 28: // no hidden
-        case 29: // no strikethrough
-          continue; // unsupported
-        case 39:
-          fg = Cell::kDefaultFg;
-          continue;
-        case 49:
-          bg = Cell::kDefaultBg;
-          continue;
-        }
-        if (a >= 30 && a < 38) {
-          fg = a - 30;
-          continue;
-        }
-        if (a >= 40 && a < 48) {
-          bg = a - 40;
-          continue;
-        }
-        if (a >= 90 && a < 98) {
-          fg = 8 + a - 90;
-          continue;
-        }
-        if (a >= 100 && a < 108) {
-          bg = 8 + a - 100;
-          continue;
+      return SGR(args);
+    }
+    if (command == "?h" || command == "?l") {
+      for (int i = 0; i < args.size(); ++i) {
+        if (!SetPrivateMode(args[i], command[1] == 'h')) {
+          DebugActions::CSI(command, args);
         }
       }
       return;
@@ -435,22 +533,236 @@ class Shell : public DebugActions {
   }
 
  private:
+  // Not echoed: the render thread owns stderr, and draws the text anyway.
+  void Print(string_view text) {
+    grid_->Put(text, style_);
+  }
+
+  void Print(const u32* runes, int count) {
+    grid_->Put(runes, count, style_);
+  }
+
   Cell Format(u32 rune) {
-    Cell result = format_;
-    result.rune = rune;
-    return result;
+    return Cell(rune, style_);
+  }
+
+  // DECSET and DECRST. Returns false if the mode is not supported.
+  bool SetPrivateMode(int mode, bool set) {
+    switch (mode) {
+    case 47: // alternate screen
+      UseAlternateScreen(set);
+      return true;
+    case 1047: // alternate screen, cleared on leaving
+      if (!set && grid_ == &alternate_) ClearScreen();
+      UseAlternateScreen(set);
+      return true;
+    case 1048: // save cursor
+      set ? SaveCursor() : RestoreCursor();
+      return true;
+    case 1049: // save cursor and use a cleared alternate screen
+      if (set) {
+        if (grid_ == &alternate_) return true;
+        SaveCursor();
+        UseAlternateScreen(true);
+        ClearScreen();
+      } else {
+        if (grid_ != &alternate_) return true;
+        UseAlternateScreen(false);
+        RestoreCursor();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Switches grid_, so no cells are copied. The new grid is redrawn.
+  void UseAlternateScreen(bool alternate) {
+    Grid* grid = alternate ? &alternate_ : &primary_;
+    if (grid == grid_) return;
+    if (grid->w() != grid_->w() || grid->h() != grid_->h()) {
+      grid->Resize(grid_->w(), grid_->h());
+    }
+    grid->Move(grid_->x(), grid_->y());
+    grid_ = grid;
+    grid_->TouchAll();
+    // Style ids are per grid.
+    style_ = grid_->Intern(format_);
+  }
+
+  // Erases the screen and its scroll region, keeping the cursor.
+  void ClearScreen() {
+    int x = grid_->x(), y = grid_->y();
+    grid_->Reset();
+    grid_->SetScrollRegion(0, grid_->h());
+    grid_->Move(x, y);
+  }
+
+  void SaveCursor() {
+    SavedCursor& saved = saved_cursors_[grid_ == &alternate_];
+    saved.x = grid_->x();
+    saved.y = grid_->y();
+    saved.format = format_;
   }
 
-  int Get(const std::vector<int>& args, int index, int def) {
-    return index >= args.size() ? def : args[index];
+  void RestoreCursor() {
+    const SavedCursor& saved = saved_cursors_[grid_ == &alternate_];
+    grid_->Move(std::min(saved.x, grid_->w() - 1),
+                std::min(saved.y, grid_->h() - 1));
+    format_ = saved.format;
+    style_ = grid_->Intern(format_);
+  }
+
+  int Get(const EscapeParser::Args& args, int index, int def) {
+    // Missing and zero parameters both take the default.
+    return index >= args.size() || args[index] == 0 ? def : args[index];
+  }
+
+  // Select graphic rendition: a single pass over the parameters, then the
+  // new style is interned once for the cells that follow.
+  void SGR(const EscapeParser::Args& args) {
+    if (args.empty()) format_ = Style();
+    auto& attr = format_.attr;
+    auto& fg = format_.fg;
+    auto& bg = format_.bg;
+    for (int i = 0; i < args.size(); ++i) {
+      int a = args[i];
+      switch (a) {
+      case 0:
+        format_ = Style();
+        continue;
+      case 1:
+        attr |= Style::kBold;
+        continue;
+      case 2: // faint
+        attr &= ~Style::kBold;
+        continue;
+      case 3:
+        attr |= Style::kItalic;
+        continue;
+      case 4: // 4:0 is no underline, 4:1 to 4:5 are underline styles.
+        if (args.sub_size(i) && args.sub(i, 0) == 0) {
+          attr &= ~Style::kUnderline;
+        } else {
+          attr |= Style::kUnderline;
+        }
+        continue;
+      case 7:
+        attr |= Style::kInverse;
+        continue;
+      case 21: // double-underline
+        attr |= Style::kUnderline;
+        continue;
+      case 22:
+        attr &= ~Style::kBold;
+        continue;
+      case 23:
+        attr &= ~Style::kItalic;
+        continue;
+      case 24:
+        attr &= ~Style::kUnderline;
+        continue;
+      case 27:
+        attr &= ~Style::kInverse;
+        continue;
+      case 5: // blink
+      case 8: // hidden
+      case 9: // strikethrough
+      case 25: // no blink
+      case 28: // no hidden
+      case 29: // no strikethrough
+      case 59: // default underline color
+        continue; // unsupported
+      case 38:
+        ExtendedColor(args, &i, &fg, Style::kDefaultFg);
+        continue;
+      case 48:
+        ExtendedColor(args, &i, &bg, Style::kDefaultBg);
+        continue;
+      case 58: { // underline color, unsupported
+        Color ignored;
+        ExtendedColor(args, &i, &ignored, 0);
+        continue;
+      }
+      case 39:
+        fg = Style::kDefaultFg;
+        continue;
+      case 49:
+        bg = Style::kDefaultBg;
+        continue;
+      }
+      if (a >= 30 && a < 38) {
+        fg = a - 30;
+        continue;
+      }
+      if (a >= 40 && a < 48) {
+        bg = a - 40;
+        continue;
+      }
+      if (a >= 90 && a < 98) {
+        fg = 8 + a - 90;
+        continue;
+      }
+      if (a >= 100 && a < 108) {
+        bg = 8 + a - 100;
+        continue;
+      }
+    }
+    style_ = grid_->Intern(format_);
+  }
+
+  // Parses the color after SGR 38, 48 or 58 at args[*i]. The color is either
+  // in sub-parameters (38:5:n, 38:2::r:g:b, or 38:2:r:g:b) or, in the older
+  // form, in the parameters that follow (38;5;n or 38;2;r;g;b), which are
+  // skipped by advancing *i.
+  void ExtendedColor(const EscapeParser::Args& args, int* i, Color* color,
+                     Color def) {
+    int index = *i;
+    int kind, values[3];
+    if (int n = args.sub_size(index)) {
+      kind = args.sub(index, 0);
+      if (kind == 5 && n >= 2) {
+        values[0] = args.sub(index, 1);
+      } else if (kind == 2 && n >= 4) {
+        // The color space ID before r:g:b is optional.
+        for (int c = 0; c < 3; ++c) values[c] = args.sub(index, n - 3 + c);
+      } else {
+        return;
+      }
+    } else {
+      kind = index + 1 < args.size() ? args[index + 1] : -1;
+      int count = kind == 5 ? 1 : kind == 2 ? 3 : 0;
+      if (count == 0 || index + 1 + count >= args.size()) {
+        // Malformed, and we can't tell where it ends.
+        *i = args.size();
+        return;
+      }
+      for (int c = 0; c < count; ++c) values[c] = args[index + 2 + c];
+      *i += 1 + count;
+    }
+    if (kind == 5) {
+      *color = values[0] < 256 ? values[0] : def;
+    } else {
+      auto level = [](int v) { return std::min(v, 255); };
+      *color = RGBColor(level(values[0]), level(values[1]), level(values[2]));
+    }
   }
 
-  Cell format_;
-  Grid grid_;
-  EscapeParser parser_;
+  Style format_;
+  u32 style_ = 0;  // format_ interned in grid_.
+  // The alternate screen has no scrollback. Switching screens switches
+  // grid_, and the other grid keeps its cells.
+  Grid primary_, alternate_;
+  Grid* grid_;
+  // Saved by DECSC and restored by DECRC. As in xterm, each screen has its
+  // own, so that DECSC on the alternate screen keeps the one ?1049h saved.
+  struct SavedCursor {
+    int x = 0, y = 0;
+    Style format;
+  } saved_cursors_[2];  // Primary, alternate.
+  BasicEscapeParser<Shell> parser_;
   int tty_;
+  PtyReader* reader_;
   WriteQueue<1024> write_queue_;
-  std::array<u8, 1024> read_buf_;
   History<192> read_history_;
   History<192> write_history_;
 };
@@ -499,7 +811,166 @@ class TermWindow {
   XIC input_context_;
 };
 
+// Waits for the main loop's fds to be readable, and meanwhile writes the
+// shell's input to the PTY master.
+class EventLoop {
+ public:
+  virtual ~EventLoop() {}
+  // Waits up to timeout ms (or forever, if negative) for any of the fds to
+  // be readable, and sets readable[i] for those that are.
+  virtual void Wait(int timeout, bool* readable) = 0;
+  // Starts writing the shell's input, if any, without waiting.
+  virtual void Flush() = 0;
+};
+
+class PollLoop final : public EventLoop {
+ public:
+  PollLoop(Shell* shell, int master, const std::vector<int>& fds)
+      : shell_(shell), master_(master) {
+    for (int fd : fds) poll_fds_.push_back({fd, POLLIN, 0});
+    poll_fds_.push_back({master, POLLOUT, 0});
+  }
+
+  void Wait(int timeout, bool* readable) override {
+    // The master is only polled when there is something to write to it.
+    pollfd& poll_master = poll_fds_.back();
+    poll_master.fd = shell_->NeedsWrite() ? master_ : -1;
+    PCHECK(poll(poll_fds_.data(), poll_fds_.size(), timeout) >= 0);
+    for (int i = 0; i + 1 < poll_fds_.size(); ++i) {
+      readable[i] = poll_fds_[i].revents & POLLIN;
+    }
+    if (poll_master.revents & POLLOUT) shell_->Write();
+  }
+
+  void Flush() override {
+    if (shell_->NeedsWrite()) shell_->Write();
+  }
+
+ private:
+  Shell* shell_;
+  int master_;
+  std::vector<pollfd> poll_fds_;  // The fds, and then the master.
+};
+
+#ifdef HAVE_IO_URING
+// Keeps multishot polls posted on the fds, so a wait is one syscall and
+// nothing needs to be re-armed. The shell's input goes out as one writev
+// op at a time, which is submitted along with the wait. If the master is
+// full, a poll for POLLOUT goes first, as in PollLoop.
+class UringLoop final : public EventLoop {
+ public:
+  UringLoop(Shell* shell, int master, const std::vector<int>& fds)
+      : shell_(shell), master_(master), fds_(fds), posted_(fds.size()) {}
+
+  // Returns false if io_uring can't be used.
+  bool Init() {
+    // Multishot polls came in Linux 5.13, with IORING_FEAT_RSRC_TAGS. Before
+    // that they fail at once, so there is no probing them.
+    return uring_.Init(16) && uring_.Has(IORING_FEAT_RSRC_TAGS) &&
+           uring_.Supports(IORING_OP_POLL_ADD) &&
+           uring_.Supports(IORING_OP_WRITEV);
+  }
+
+  void Wait(int timeout, bool* readable) override {
+    for (int i = 0; i < fds_.size(); ++i) {
+      readable[i] = false;
+      if (posted_[i]) continue;
+      io_uring_sqe* sqe = uring_.Prepare(IORING_OP_POLL_ADD, fds_[i], i);
+      CHECK(sqe);
+      sqe->poll32_events = POLLIN;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      posted_[i] = true;
+    }
+    PrepareWrite();
+    int result = uring_.Enter(1, timeout);
+    if (result < 0 && result != -ETIME && result != -EINTR) {
+      errno = -result;
+      PCHECK(false);
+    }
+    uring_.Reap([&](const io_uring_cqe& cqe) {
+      if (cqe.user_data == kWrite) {
+        writing_ = false;
+        if (cqe.res >= 0) {
+          shell_->Wrote(cqe.res);
+        } else if (cqe.res == -EAGAIN) {
+          blocked_ = true;
+        } else if (cqe.res != -EINTR) {
+          fprintf(stderr, "writing to master: %s\n", strerror(-cqe.res));
+        }
+        return;
+      }
+      if (cqe.res < 0) {
+        fprintf(stderr, "polling fd %d: %s\n",
+                cqe.user_data == kWritable ? master_ : fds_[cqe.user_data],
+                strerror(-cqe.res));
+        PCHECK(false);
+      }
+      if (cqe.user_data == kWritable) {
+        polling_master_ = blocked_ = false;
+        return;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE)) posted_[cqe.user_data] = false;
+      if (cqe.res > 0) readable[cqe.user_data] = true;
+    });
+  }
+
+  void Flush() override {
+    if (PrepareWrite()) uring_.Enter(0, 0);
+  }
+
+ private:
+  // user_data, or else an fd index.
+  constexpr static u64 kWrite = ~u64(0);
+  constexpr static u64 kWritable = ~u64(1);
+
+  // Prepares a write of the shell's input, unless one is in flight. If the
+  // last write found the master full, prepares a poll for it instead.
+  bool PrepareWrite() {
+    if (writing_ || polling_master_ || !shell_->NeedsWrite()) return false;
+    if (blocked_) {
+      io_uring_sqe* sqe =
+          uring_.Prepare(IORING_OP_POLL_ADD, master_, kWritable);
+      if (!sqe) return false;
+      sqe->poll32_events = POLLOUT;
+      polling_master_ = true;
+      return true;
+    }
+    io_uring_sqe* sqe = uring_.Prepare(IORING_OP_WRITEV, master_, kWrite);
+    if (!sqe) return false;
+    sqe->addr = reinterpret_cast<u64>(write_blocks_);
+    sqe->len = shell_->GetWriteBlocks(write_blocks_);
+    sqe->off = -1;  // Not seekable.
+    writing_ = true;
+    return true;
+  }
+
+  Shell* shell_;
+  int master_;
+  std::vector<int> fds_;
+  std::vector<bool> posted_;  // Whether fds_[i] has a poll posted.
+  bool writing_ = false;
+  bool blocked_ = false;  // The last write found the master full.
+  bool polling_master_ = false;  // For POLLOUT, since it was full.
+  iovec write_blocks_[Shell::kMaxWriteBlocks];  // Being written.
+  Uring uring_;
+};
+#endif // HAVE_IO_URING
+
 int main(int argc, char** argv) {
+  bool spill_scrollback = false;
+  bool io_uring = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--spill-scrollback")) {
+      // Unlimited scrollback, kept in a file rather than in memory.
+      spill_scrollback = true;
+    } else if (!strcmp(argv[i], "--io-uring")) {
+      // Wait and do I/O with io_uring, if the kernel supports it.
+      io_uring = true;
+    } else {
+      fprintf(stderr, "Unknown flag %s\n", argv[i]);
+      return 1;
+    }
+  }
   int master, slave;
   PCHECK(!openpty(&master, &slave, nullptr, nullptr, nullptr));
   int shell_pid = fork();
@@ -514,24 +985,66 @@ int main(int argc, char** argv) {
   Display* display = XOpenDisplay(nullptr);
   CHECK(display);
   TermWindow window(display);
-  Shell shell(master);
+  PtyReader reader(master, io_uring);
+  Renderer renderer;
+  Shell shell(master, &reader);
+  if (spill_scrollback) shell.SpillScrollback(CacheDir().c_str());
 
-  pollfd poll_fds[] = {
-    {master, POLLIN, 0},
-    {XConnectionNumber(display), POLLIN, 0},
+  std::vector<int> fds = {
+    reader.fd(),
+    renderer.fd(),
+    XConnectionNumber(display),
   };
-  pollfd& poll_master = poll_fds[0];
+  std::unique_ptr<EventLoop> loop;
+#ifdef HAVE_IO_URING
+  if (io_uring) {
+    auto uring_loop = std::make_unique<UringLoop>(&shell, master, fds);
+    if (uring_loop->Init()) loop = std::move(uring_loop);
+  }
+#endif
+  if (io_uring && !loop) fprintf(stderr, "No io_uring, using poll()\n");
+  if (!loop) loop = std::make_unique<PollLoop>(&shell, master, fds);
+  bool readable[3];
 
+  // Frames are drawn at most once per kFrameInterval, so heavy output is
+  // limited by parsing rather than drawing. In between, output is read until
+  // the next frame is due or there is no more. After a keypress the next
+  // frame is due at once, so that echoes aren't delayed. A frame that is
+  // due while the renderer is busy waits for it to draw a frame.
+  using Clock = std::chrono::steady_clock;
+  constexpr auto kFrameInterval = std::chrono::microseconds(16667);
+  Clock::time_point next_frame = Clock::now();
+  bool changed = false;  // Since the last frame.
   while (1) {
-    poll_master.events = POLLIN | (shell.NeedsWrite() ? POLLOUT : 0);
-    PCHECK(poll(poll_fds, sizeof(poll_fds)/sizeof(poll_fds[0]), 1000) >= 0);
-    if (poll_master.revents & POLLIN) shell.Read();
-    if (poll_master.revents & POLLOUT) shell.Write();
+    int timeout = 1000;
+    if (reader.HasBlock()) {
+      timeout = 0;  // Left over when the last frame was due.
+    } else if (changed && renderer.CanAcquire()) {
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+          next_frame - Clock::now());
+      timeout = std::max<int>(wait.count(), 0);
+    }
+    loop->Wait(timeout, readable);
+    if (readable[0]) reader.Acknowledge();
+    if (readable[1]) renderer.Acknowledge();
+    if (reader.HasBlock()) {
+      changed = true;
+      while (shell.Read() && Clock::now() < next_frame) {}
+    }
     while (XPending(display)) {
       XEvent event;
       XNextEvent(display, &event);
-      if (auto keypress = window.DecodeKeypress(&event)) shell.Key(*keypress);
+      if (auto keypress = window.DecodeKeypress(&event)) {
+        shell.Key(*keypress);
+        next_frame = Clock::now();
+      }
+    }
+    // Send keys right away, rather than after the next wait.
+    loop->Flush();
+    Clock::time_point now = Clock::now();
+    if (changed && now >= next_frame && shell.Update(&renderer)) {
+      changed = false;
+      next_frame = now + kFrameInterval;
     }
-    shell.Update();
   }
 }
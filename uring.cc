@@ -0,0 +1,145 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void* Map(int fd, size_t size, u64 offset) {
+  void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  return map == MAP_FAILED ? nullptr : map;
+}
+
+template <typename T>
+static T* At(void* base, u32 offset) {
+  return reinterpret_cast<T*>(static_cast<u8*>(base) + offset);
+}
+
+Uring::~Uring() {
+  if (buffer_ring_) munmap(buffer_ring_, buffer_ring_size_);
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (ring_) munmap(ring_, ring_size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool Uring::Init(unsigned entries) {
+  io_uring_params params = {};
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) return false;
+  features_ = params.features;
+  // Linux 5.11: one mapping for both queues, and timeouts when waiting.
+  constexpr u32 kFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+  if ((params.features & kFeatures) != kFeatures) return false;
+
+  ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(u32),
+                        params.cq_off.cqes +
+                            params.cq_entries * sizeof(io_uring_cqe));
+  ring_ = Map(fd_, ring_size_, IORING_OFF_SQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(Map(fd_, sqes_size_, IORING_OFF_SQES));
+  if (!ring_ || !sqes_) return false;
+  sq_head_ = At<unsigned>(ring_, params.sq_off.head);
+  sq_tail_ = At<unsigned>(ring_, params.sq_off.tail);
+  sq_mask_ = At<unsigned>(ring_, params.sq_off.ring_mask);
+  sq_array_ = At<unsigned>(ring_, params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = At<unsigned>(ring_, params.cq_off.head);
+  cq_tail_ = At<unsigned>(ring_, params.cq_off.tail);
+  cq_mask_ = At<unsigned>(ring_, params.cq_off.ring_mask);
+  cqes_ = At<io_uring_cqe>(ring_, params.cq_off.cqes);
+
+  constexpr int kMaxOps = 256;
+  std::vector<u8> probe_data(sizeof(io_uring_probe) +
+                             kMaxOps * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(probe_data.data());
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+              kMaxOps) < 0) {
+    return false;
+  }
+  supported_.assign(kMaxOps, false);
+  for (int i = 0; i < probe->ops_len; ++i) {
+    supported_[probe->ops[i].op] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+  }
+  return true;
+}
+
+io_uring_sqe* Uring::Prepare(u8 opcode, int fd, u64 user_data) {
+  unsigned tail = *sq_tail_ + sq_pending_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+    return nullptr;
+  }
+  unsigned index = tail & *sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  sq_array_[index] = index;
+  ++sq_pending_;
+  return sqe;
+}
+
+int Uring::Enter(unsigned wait, int timeout) {
+  unsigned tail = *sq_tail_ + sq_pending_;
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  sq_pending_ = 0;
+  // Including any that an earlier call failed to submit.
+  unsigned submit = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  io_uring_getevents_arg arg = {};
+  __kernel_timespec timespec = {};
+  void* argp = nullptr;
+  size_t arg_size = 0;
+  if (wait && timeout >= 0) {
+    timespec.tv_sec = timeout / 1000;
+    timespec.tv_nsec = timeout % 1000 * 1000000;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<u64>(&timespec);
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    arg_size = sizeof(arg);
+  }
+  int submitted =
+      syscall(__NR_io_uring_enter, fd_, submit, wait, flags, argp, arg_size);
+  return submitted < 0 ? -errno : submitted;
+}
+
+bool Uring::ProvideBuffers(int count, int size) {
+  buffer_ring_size_ = count * sizeof(io_uring_buf);
+  void* ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) return false;
+  buffer_ring_ = static_cast<io_uring_buf_ring*>(ring);
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = reinterpret_cast<u64>(ring);
+  reg.ring_entries = count;
+  reg.bgid = kBufferGroup;
+  // Linux 5.19.
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    return false;
+  }
+  buffer_count_ = count;
+  buffer_size_ = size;
+  buffers_.reset(new u8[count * size]);
+  for (int id = 0; id < count; ++id) Recycle(id);
+  return true;
+}
+
+void Uring::Recycle(int id) {
+  u16 tail = buffer_ring_->tail;
+  // Not bufs[], which C++ puts after an empty struct rather than at 0.
+  auto* bufs = reinterpret_cast<io_uring_buf*>(buffer_ring_);
+  io_uring_buf& buf = bufs[tail & (buffer_count_ - 1)];
+  buf.addr = reinterpret_cast<u64>(buffer(id));
+  buf.len = buffer_size_;
+  buf.bid = id;
+  __atomic_store_n(&buffer_ring_->tail, u16(tail + 1), __ATOMIC_RELEASE);
+}
+#endif // HAVE_IO_URING
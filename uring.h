@@ -0,0 +1,101 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "base.h"
+
+#include <memory>
+#include <vector>
+
+// Provided buffer rings need 5.19 headers. Older ones fall back to poll.
+#if __has_include(<linux/io_uring.h>)
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+constexpr u8 kOpReadMultishot = IORING_OP_READ_MULTISHOT;
+#else
+// Older headers lack it, but newer kernels still run it.
+constexpr u8 kOpReadMultishot = 49;
+#endif
+
+// Just enough of io_uring for our event loops, set up with raw syscalls
+// rather than liburing. One thread uses each ring.
+//
+// Reads can pick buffers from a group that the ring provides, so that a
+// multishot read stays posted and its data turns up in completions.
+class Uring {
+ public:
+  Uring() {}
+  ~Uring();
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  // Returns false if the kernel has no io_uring, e.g. because it is too
+  // old or io_uring is disabled, or lacks features we need.
+  bool Init(unsigned entries);
+  // IORING_FEAT_* flags.
+  bool Has(u32 features) const { return (features_ & features) == features; }
+  bool Supports(u8 opcode) const {
+    return opcode < supported_.size() && supported_[opcode];
+  }
+
+  // A zeroed submission to fill in, or nullptr if the queue is full.
+  io_uring_sqe* Prepare(u8 opcode, int fd, u64 user_data);
+  // Submits what was prepared, and waits up to timeout ms (or forever, if
+  // negative) for wait completions. Returns -errno on failure, e.g. -ETIME
+  // or -EINTR.
+  int Enter(unsigned wait, int timeout);
+  // Calls f(const io_uring_cqe&) for each completion, and drops them.
+  template <typename F>
+  void Reap(F f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) f(cqes_[head & *cq_mask_]);
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // Provides count buffers of size bytes, as group kBufferGroup, for reads
+  // with IOSQE_BUFFER_SELECT. count is a power of 2.
+  constexpr static u16 kBufferGroup = 0;
+  bool ProvideBuffers(int count, int size);
+  // The buffer that a completion with IORING_CQE_F_BUFFER used.
+  static int BufferId(const io_uring_cqe& cqe) {
+    return cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+  u8* buffer(int id) { return &buffers_[id * buffer_size_]; }
+  // Gives a buffer back once its data is used.
+  void Recycle(int id);
+
+ private:
+  int fd_ = -1;
+  void* ring_ = nullptr;
+  size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned sq_pending_ = 0;  // Prepared, but not yet submitted.
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+  u32 features_ = 0;
+  std::vector<bool> supported_;  // By opcode.
+
+  io_uring_buf_ring* buffer_ring_ = nullptr;
+  size_t buffer_ring_size_ = 0;
+  int buffer_count_ = 0;
+  int buffer_size_ = 0;
+  std::unique_ptr<u8[]> buffers_;
+};
+#endif // HAVE_IO_URING
+
+#endif // URING_H_
@@ -0,0 +1,72 @@
+#include "utf8.h"
+
+int UTF8Decoder::DecodeWhole(const u8* begin, const u8* end, u32* rune) {
+  u8 lead = begin[0];
+  int length = lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+  if (end - begin < length) return 0;
+  u32 value = lead & (0x7f >> length);
+  for (int i = 1; i < length; ++i) {
+    if ((begin[i] & 0xc0) != 0x80) return 0;
+    value = value << 6 | (begin[i] & 0x3f);
+  }
+  // Reject overlong forms, surrogates and values past U+10FFFF.
+  constexpr static u32 kMin[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (value < kMin[length] || (value >= 0xd800 && value < 0xe000) ||
+      value > 0x10ffff) {
+    return 0;
+  }
+  *rune = value;
+  return length;
+}
+
+const u8* UTF8Decoder::Decode(const u8* begin, const u8* end, u32* out,
+                              int max, int* count) {
+  int n = 0;
+  while (begin != end && n < max) {
+    u8 b = *begin;
+    if (needed_ == 0) {
+      if (b < 0x80) break;
+      if (LIKELY(b >= 0xc2 && b < 0xf5)) {
+        if (int length = DecodeWhole(begin, end, &out[n])) {
+          ++n;
+          begin += length;
+          continue;
+        }
+      }
+      // Invalid or cut off: go byte by byte.
+      ++begin;
+      if (b >= 0xc2 && b < 0xe0) {
+        needed_ = 1;
+        rune_ = b & 0x1f;
+      } else if (b >= 0xe0 && b < 0xf0) {
+        if (b == 0xe0) lower_ = 0xa0;
+        if (b == 0xed) upper_ = 0x9f;
+        needed_ = 2;
+        rune_ = b & 0xf;
+      } else if (b >= 0xf0 && b < 0xf5) {
+        if (b == 0xf0) lower_ = 0x90;
+        if (b == 0xf4) upper_ = 0x8f;
+        needed_ = 3;
+        rune_ = b & 0x7;
+      } else {
+        out[n++] = kReplacement;
+      }
+      continue;
+    }
+    if (b < lower_ || b > upper_) {
+      // The sequence so far is one error, and b is decoded afresh.
+      needed_ = 0;
+      lower_ = 0x80;
+      upper_ = 0xbf;
+      out[n++] = kReplacement;
+      continue;
+    }
+    ++begin;
+    lower_ = 0x80;
+    upper_ = 0xbf;
+    rune_ = rune_ << 6 | (b & 0x3f);
+    if (--needed_ == 0) out[n++] = rune_;
+  }
+  *count = n;
+  return begin;
+}
@@ -0,0 +1,57 @@
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include "base.h"
+
+// Writes the UTF-8 encoding of rune to out, returning the number of bytes.
+inline int EncodeUTF8(u32 rune, char* out) {
+  if (LIKELY(rune < 0x80)) {
+    out[0] = rune;
+    return 1;
+  }
+  if (rune < 0x800) {
+    out[0] = 0xc0 | (rune >> 6);
+    out[1] = 0x80 | (rune & 0x3f);
+    return 2;
+  }
+  if (rune < 0x10000) {
+    out[0] = 0xe0 | (rune >> 12);
+    out[1] = 0x80 | ((rune >> 6) & 0x3f);
+    out[2] = 0x80 | (rune & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (rune >> 18);
+  out[1] = 0x80 | ((rune >> 12) & 0x3f);
+  out[2] = 0x80 | ((rune >> 6) & 0x3f);
+  out[3] = 0x80 | (rune & 0x3f);
+  return 4;
+}
+
+// Streaming UTF-8 decoder for the bytes read from the terminal.
+// It only decodes multi-byte sequences: callers handle ASCII themselves, on
+// faster paths. A sequence split across buffers is carried over to the next
+// call. Invalid input decodes to U+FFFD, once per maximal subpart, as in the
+// WHATWG encoding standard.
+class UTF8Decoder {
+ public:
+  constexpr static u32 kReplacement = 0xfffd;
+
+  // Whether a sequence was cut off at the end of the last buffer.
+  bool pending() const { return needed_ != 0; }
+
+  // Decodes runes from [begin, end) into out, stopping at the end, after max
+  // runes, or at an ASCII byte that isn't part of a sequence. Sets *count to
+  // the number of runes and returns the first byte not consumed.
+  const u8* Decode(const u8* begin, const u8* end, u32* out, int max, int* count);
+
+ private:
+  // Decodes a whole sequence starting at begin if it is valid and entirely
+  // in the buffer, the common case. Returns its length, or 0.
+  static int DecodeWhole(const u8* begin, const u8* end, u32* rune);
+
+  u32 rune_ = 0;
+  int needed_ = 0;  // Continuation bytes still expected.
+  u8 lower_ = 0x80, upper_ = 0xbf;  // Range of the next continuation byte.
+};
+
+#endif // UTF8_H_
@@ -0,0 +1,25 @@
+#ifndef WIDTH_H_
+#define WIDTH_H_
+
+#include "base.h"
+
+// How many columns each rune takes up, in two levels: 256-rune blocks,
+// and 2 bits per rune in the blocks that are not all the same width.
+struct RuneWidthTable {
+  constexpr static int kMaxBlocks = 256;
+  u8 blocks[0x110000 >> 8];  // Index in widths.
+  u8 widths[kMaxBlocks][64];
+};
+
+// Generated at compile time in width.cc.
+extern const RuneWidthTable kRuneWidths;
+
+// 0 for combining marks and other zero-width runes, 2 for wide (East Asian)
+// runes, and otherwise 1. Controls are not handled.
+inline int RuneWidth(u32 rune) {
+  if (UNLIKELY(rune >= 0x110000)) return 1;
+  u8 block = kRuneWidths.blocks[rune >> 8];
+  return kRuneWidths.widths[block][(rune & 0xff) >> 2] >> (rune & 3) * 2 & 3;
+}
+
+#endif // WIDTH_H_